@@ -0,0 +1,119 @@
+#define _GNU_SOURCE  // cpu_set_t and pthread_setaffinity_np
+#include "affinity.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(KVS_HAVE_NUMA) && __has_include(<numa.h>)
+#include <numa.h>
+#define USE_NUMA 1
+#else
+#define USE_NUMA 0
+#endif
+
+static size_t worker_cpus[CPU_SETSIZE];  // In the order they were listed
+static size_t num_worker_cpus = 0;
+static cpu_set_t backup_cpus;            // Allowed CPUs not used by workers
+static int numa_ok = 0;
+
+// Parses "a" or "a-b" into a range of CPU numbers.
+static int parse_range(const char *text, char **end, size_t *first, size_t *last) {
+    long a = strtol(text, end, 10), b = a;
+    if (*end == text) return 1;
+    if (**end == '-') {
+        const char *start = *end + 1;
+        b = strtol(start, end, 10);
+        if (*end == start) return 1;
+    }
+    if (a < 0 || b < a || b >= CPU_SETSIZE) return 1;
+    *first = (size_t)a;
+    *last = (size_t)b;
+    return 0;
+}
+
+int affinity_set_workers(const char *cpu_list) {
+    cpu_set_t allowed, listed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("Failed to read the CPU affinity");
+        return 1;
+    }
+    CPU_ZERO(&listed);
+    num_worker_cpus = 0;
+    const char *p = cpu_list;
+    for (;;) {
+        char *end;
+        size_t first, last;
+        if (parse_range(p, &end, &first, &last) != 0 || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Invalid CPU list: %s\n", cpu_list);
+            return 1;
+        }
+        for (size_t cpu = first; cpu <= last; cpu++) {
+            if (!CPU_ISSET(cpu, &allowed)) {
+                fprintf(stderr, "CPU %zu is not available\n", cpu);
+                return 1;
+            }
+            if (!CPU_ISSET(cpu, &listed)) {
+                CPU_SET(cpu, &listed);
+                worker_cpus[num_worker_cpus++] = cpu;
+            }
+        }
+        if (*end == '\0') break;
+        p = end + 1;
+    }
+    CPU_XOR(&backup_cpus, &allowed, &listed);
+#if USE_NUMA
+    numa_ok = numa_available() >= 0;
+#endif
+    return 0;
+}
+
+void affinity_pin_worker(unsigned int index) {
+    if (num_worker_cpus == 0) return;
+    size_t cpu = worker_cpus[index % num_worker_cpus];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Failed to pin worker %u to CPU %zu\n", index, cpu);
+        return;
+    }
+#if USE_NUMA
+    // Pairs this worker writes are allocated on its own node
+    if (numa_ok) {
+        int node = numa_node_of_cpu((int)cpu);
+        if (node >= 0) numa_set_preferred(node);
+    }
+#endif
+}
+
+void affinity_pin_backup() {
+    if (num_worker_cpus == 0) return;
+    if (CPU_COUNT(&backup_cpus) == 0) {
+        // Sharing a worker CPU beats not running backups at all
+        fprintf(stderr, "No CPU left for the backup thread, leaving it unpinned\n");
+        return;
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(backup_cpus), &backup_cpus) != 0) {
+        fprintf(stderr, "Failed to pin the backup thread\n");
+        return;
+    }
+#if USE_NUMA
+    // Its CPUs may span nodes: allocate wherever it happens to run
+    if (numa_ok) numa_set_localalloc();
+#endif
+}
+
+void affinity_describe(int fd) {
+    if (num_worker_cpus == 0) {
+        dprintf(fd, "affinity: threads not pinned\n");
+        return;
+    }
+    dprintf(fd, "affinity: workers on cpus");
+    for (size_t i = 0; i < num_worker_cpus; i++) {
+        dprintf(fd, "%s%zu", i ? "," : " ", worker_cpus[i]);
+    }
+    dprintf(fd, ", backup on %d other cpus, numa %s\n", CPU_COUNT(&backup_cpus),
+            numa_ok ? "local allocation" : "unavailable");
+}
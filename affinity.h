@@ -0,0 +1,26 @@
+#ifndef KVS_AFFINITY_H
+#define KVS_AFFINITY_H
+
+/// Thread placement. Workers can be pinned to a list of CPUs, one CPU each in
+/// turn, and the backup thread is then kept on the remaining CPUs. When
+/// libnuma is available each pinned thread also prefers memory from its own
+/// node, so the keys and values it writes stay local to it. Without a CPU
+/// list every function here does nothing.
+
+/// Sets the CPUs workers run on. Must be called before any thread is pinned.
+/// @param cpu_list CPUs such as "0-3,8,10-11".
+/// @return 0 if the list is valid, 1 otherwise.
+int affinity_set_workers(const char *cpu_list);
+
+/// Pins the calling worker thread.
+/// @param index Index of the worker, picks its CPU from the list.
+void affinity_pin_worker(unsigned int index);
+
+/// Moves the calling backup thread off the worker CPUs, if any remain.
+void affinity_pin_backup();
+
+/// Writes where workers and the backup thread are placed.
+/// @param fd File descriptor to write to.
+void affinity_describe(int fd);
+
+#endif  // KVS_AFFINITY_H
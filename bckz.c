@@ -0,0 +1,521 @@
+#include "bckz.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef KVS_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#define BCKZ_MAGIC "KVSZ"
+#define BCKZ_INDEX_MAGIC "KVSZIDX1"
+#define BCKZ_VERSION 1u
+#define HEADER_SIZE 12        // Magic, version, block size
+#define BLOCK_HEADER_SIZE 9   // Codec, raw length, stored length
+#define TRAILER_SIZE 24       // Index offset, number of blocks, magic
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535u
+
+enum { CODEC_RAW = 0, CODEC_LZ = 1, CODEC_LZ4 = 2 };
+
+typedef struct IndexEntry {
+    uint64_t offset;
+    uint32_t raw_len, stored_len;
+} IndexEntry;
+
+typedef struct Block {
+    uint8_t *raw, *packed;
+    size_t raw_len, packed_len;
+    uint8_t codec;
+    int done;                 // Compressed, waiting to be written
+} Block;
+
+struct BckzWriter {
+    int fd;
+    bckz_output output;
+    int failed;
+    unsigned int threads;     // Compressors to start once a second block is needed
+    pthread_t workers[BCKZ_MAX_THREADS];
+    unsigned int num_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;     // A block was submitted, or the writer is closing
+    pthread_cond_t done;      // A block was compressed
+    int stopping;
+    Block *blocks;            // Ring of blocks, indexed by sequence number
+    size_t num_slots;
+    uint64_t submitted, taken, written;
+    uint64_t offset;          // Where the next block goes in the file
+    IndexEntry *index;
+    size_t index_cap;
+};
+
+struct BckzReader {
+    int fd;
+    size_t num_blocks;
+    IndexEntry *index;
+    uint8_t *packed;
+};
+
+static atomic_uint_fast64_t raw_bytes = 0, stored_bytes = 0;
+
+// Built-in codec, in the spirit of LZ4: each sequence is a token holding the
+// literal count and match length in a nibble each, longer counts continued
+// in bytes of 255, the literals, and a 16 bit match offset. The last
+// sequence has only literals.
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static size_t lz_hash(uint32_t v) {
+    return (size_t)((v * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+static uint8_t *put_length(uint8_t *op, const uint8_t *oend, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op == oend) return NULL;
+        *op++ = 255;
+    }
+    if (op == oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, size_t lit, size_t offset,
+                             size_t match) {
+    if (op == oend) return NULL;
+    size_t extra = match ? match - LZ_MIN_MATCH : 0;
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit < 15 ? lit : 15) << 4 | (extra < 15 ? extra : 15));
+    if (lit >= 15 && !(op = put_length(op, oend, lit - 15))) return NULL;
+    if ((size_t)(oend - op) < lit) return NULL;
+    memcpy(op, literals, lit);
+    op += lit;
+    if (match == 0) return op;
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    if (extra >= 15 && !(op = put_length(op, oend, extra - 15))) return NULL;
+    return op;
+}
+
+// Returns the compressed size, 0 if it would not fit in cap.
+static size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    uint32_t table[1u << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t *ip = src, *anchor = src, *end = src + len;
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+    while (end - ip >= LZ_MIN_MATCH) {
+        uint32_t seq = read32(ip);
+        size_t h = lz_hash(seq);
+        const uint8_t *ref = src + table[h];
+        table[h] = (uint32_t)(ip - src);
+        if (ref >= ip || (size_t)(ip - ref) > LZ_MAX_OFFSET || read32(ref) != seq) {
+            ip++;
+            continue;
+        }
+        size_t match = LZ_MIN_MATCH;
+        while (ip + match < end && ref[match] == ip[match]) match++;
+        op = put_sequence(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), match);
+        if (!op) return 0;
+        ip += match;
+        anchor = ip;
+    }
+    op = put_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip == iend) return 1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+static int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t raw_len) {
+    const uint8_t *ip = src, *iend = src + len;
+    uint8_t *op = dst, *oend = dst + raw_len;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(&ip, iend, &lit) != 0) return 1;
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) return 1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return 1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15u;
+        if (match == 15 && get_length(&ip, iend, &match) != 0) return 1;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < match) return 1;
+        // Byte by byte: the match may overlap what it produces
+        const uint8_t *ref = op - offset;
+        for (size_t i = 0; i < match; i++) op[i] = ref[i];
+        op += match;
+    }
+    return op != oend;
+}
+
+// Keeps whichever is smaller: the block compressed or as it is.
+static void compress_block(Block *b) {
+    size_t size = 0;
+#ifdef KVS_HAVE_LZ4
+    int lz4_size = LZ4_compress_default((const char *)b->raw, (char *)b->packed, (int)b->raw_len, (int)b->raw_len);
+    size = lz4_size > 0 ? (size_t)lz4_size : 0;
+    b->codec = CODEC_LZ4;
+#else
+    size = lz_compress(b->raw, b->raw_len, b->packed, b->raw_len);
+    b->codec = CODEC_LZ;
+#endif
+    if (size == 0 || size >= b->raw_len) {
+        b->codec = CODEC_RAW;
+        size = b->raw_len;
+    }
+    b->packed_len = size;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const uint8_t *p = data;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written <= 0) return 1;
+        p += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+static void put_bytes(BckzWriter *w, const void *data, size_t len) {
+    if (!w->failed && w->output(w->fd, data, len) != 0) {
+        perror("Error writing compressed backup");
+        w->failed = 1;
+    }
+    w->offset += len;
+    atomic_fetch_add_explicit(&stored_bytes, len, memory_order_relaxed);
+}
+
+// Writes a compressed block and records it in the index. Only the caller of
+// the writer's functions writes to the file.
+static void write_block(BckzWriter *w, Block *b) {
+    if (w->written >= w->index_cap) {
+        size_t cap = w->index_cap ? w->index_cap * 2 : 64;
+        IndexEntry *grown = realloc(w->index, cap * sizeof(IndexEntry));
+        if (!grown) {
+            w->failed = 1;
+            b->raw_len = 0;
+            return;
+        }
+        w->index = grown;
+        w->index_cap = cap;
+    }
+    uint32_t lengths[2] = {(uint32_t)b->raw_len, (uint32_t)b->packed_len};
+    uint8_t header[BLOCK_HEADER_SIZE];
+    header[0] = b->codec;
+    memcpy(header + 1, lengths, sizeof(lengths));
+    w->index[w->written] = (IndexEntry){w->offset, lengths[0], lengths[1]};
+    put_bytes(w, header, sizeof(header));
+    put_bytes(w, b->codec == CODEC_RAW ? b->raw : b->packed, b->packed_len);
+    atomic_fetch_add_explicit(&raw_bytes, b->raw_len, memory_order_relaxed);
+    b->raw_len = 0;
+}
+
+static void *compress_func(void *arg) {
+    BckzWriter *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->taken == w->submitted && !w->stopping) {
+            pthread_cond_wait(&w->ready, &w->lock);
+        }
+        if (w->taken == w->submitted) break;
+        Block *b = &w->blocks[w->taken++ % w->num_slots];
+        pthread_mutex_unlock(&w->lock);
+        compress_block(b);
+        pthread_mutex_lock(&w->lock);
+        b->done = 1;
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Starts the compressors. Without them blocks are compressed in the caller.
+static void start_workers(BckzWriter *w) {
+    unsigned int threads = w->threads;
+    w->threads = 0;
+    Block *blocks = realloc(w->blocks, 2 * threads * sizeof(Block));
+    if (!blocks) return;
+    w->blocks = blocks;
+    for (size_t i = w->num_slots; i < 2 * threads; i++) {
+        w->blocks[i] = (Block){NULL, NULL, 0, 0, CODEC_RAW, 0};
+    }
+    w->num_slots = 2 * threads;
+    while (w->num_workers < threads &&
+           pthread_create(&w->workers[w->num_workers], NULL, compress_func, w) == 0) {
+        w->num_workers++;
+    }
+}
+
+// Writes the oldest block once it is compressed. Called with w->lock held.
+static void write_oldest(BckzWriter *w) {
+    Block *b = &w->blocks[w->written % w->num_slots];
+    while (!b->done) {
+        pthread_cond_wait(&w->done, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    write_block(w, b);
+    pthread_mutex_lock(&w->lock);
+    b->done = 0;
+    w->written++;
+}
+
+// Hands the current block over and makes sure the next one is free.
+static void submit(BckzWriter *w) {
+    Block *b = &w->blocks[w->submitted % w->num_slots];
+    if (w->num_workers == 0) {
+        compress_block(b);
+        w->submitted++;
+        write_block(w, b);
+        w->written++;
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    w->submitted++;
+    pthread_cond_signal(&w->ready);
+    // Write whatever is ready, and wait only if the ring is full
+    while (w->written < w->submitted &&
+           (w->submitted - w->written == w->num_slots || w->blocks[w->written % w->num_slots].done)) {
+        write_oldest(w);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Makes sure the block being filled has its buffers.
+static int current_block(BckzWriter *w, Block **block) {
+    Block *b = &w->blocks[w->submitted % w->num_slots];
+    if (!b->raw) {
+        b->raw = malloc(BCKZ_BLOCK_SIZE);
+        b->packed = malloc(BCKZ_BLOCK_SIZE);
+        if (!b->raw || !b->packed) {
+            free(b->raw);
+            free(b->packed);
+            b->raw = b->packed = NULL;
+            return 1;
+        }
+    }
+    *block = b;
+    return 0;
+}
+
+BckzWriter *bckz_open(int fd, unsigned int threads, bckz_output output) {
+    BckzWriter *w = calloc(1, sizeof(BckzWriter));
+    if (!w) return NULL;
+    w->blocks = calloc(1, sizeof(Block));
+    if (!w->blocks) {
+        free(w);
+        return NULL;
+    }
+    w->fd = fd;
+    w->output = output ? output : write_all;
+    w->num_slots = 1;
+    w->threads = threads > BCKZ_MAX_THREADS ? BCKZ_MAX_THREADS : threads;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->ready, NULL);
+    pthread_cond_init(&w->done, NULL);
+
+    uint32_t fields[2] = {BCKZ_VERSION, BCKZ_BLOCK_SIZE};
+    uint8_t header[HEADER_SIZE];
+    memcpy(header, BCKZ_MAGIC, 4);
+    memcpy(header + 4, fields, sizeof(fields));
+    put_bytes(w, header, sizeof(header));
+    return w;
+}
+
+int bckz_write(BckzWriter *w, const char *data, size_t len) {
+    while (len > 0) {
+        Block *b;
+        if (current_block(w, &b) != 0) {
+            w->failed = 1;
+            return 1;
+        }
+        size_t n = BCKZ_BLOCK_SIZE - b->raw_len;
+        if (n > len) n = len;
+        memcpy(b->raw + b->raw_len, data, n);
+        b->raw_len += n;
+        data += n;
+        len -= n;
+        if (b->raw_len == BCKZ_BLOCK_SIZE) {
+            // More than one block: worth compressing them in parallel
+            if (w->threads > 0 && w->submitted == 0) start_workers(w);
+            submit(w);
+        }
+    }
+    return w->failed;
+}
+
+int bckz_close(BckzWriter *w) {
+    Block *b = &w->blocks[w->submitted % w->num_slots];
+    if (b->raw_len > 0) submit(w);
+    pthread_mutex_lock(&w->lock);
+    while (w->written < w->submitted) {
+        write_oldest(w);
+    }
+    w->stopping = 1;
+    pthread_cond_broadcast(&w->ready);
+    pthread_mutex_unlock(&w->lock);
+    for (unsigned int i = 0; i < w->num_workers; i++) {
+        pthread_join(w->workers[i], NULL);
+    }
+
+    uint64_t trailer[2] = {w->offset, w->written};
+    // A failed file is incomplete anyway, and its index may be too
+    if (!w->failed && w->written > 0) put_bytes(w, w->index, (size_t)w->written * sizeof(IndexEntry));
+    put_bytes(w, trailer, sizeof(trailer));
+    put_bytes(w, BCKZ_INDEX_MAGIC, 8);
+    int result = w->failed;
+
+    for (size_t i = 0; i < w->num_slots; i++) {
+        free(w->blocks[i].raw);
+        free(w->blocks[i].packed);
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->ready);
+    pthread_cond_destroy(&w->done);
+    free(w->blocks);
+    free(w->index);
+    free(w);
+    return result;
+}
+
+static int read_at(int fd, void *data, size_t len, uint64_t offset) {
+    uint8_t *p = data;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+        if (n <= 0) return 1;
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+BckzReader *bckz_reader_open(int fd) {
+    struct stat st;
+    uint8_t header[HEADER_SIZE], trailer[TRAILER_SIZE];
+    uint32_t fields[2];
+    uint64_t index_at[2];
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < HEADER_SIZE + TRAILER_SIZE ||
+        read_at(fd, header, sizeof(header), 0) != 0 ||
+        read_at(fd, trailer, sizeof(trailer), (uint64_t)st.st_size - TRAILER_SIZE) != 0) {
+        return NULL;
+    }
+    memcpy(fields, header + 4, sizeof(fields));
+    memcpy(index_at, trailer, sizeof(index_at));
+    uint64_t index_end = (uint64_t)st.st_size - TRAILER_SIZE;
+    if (memcmp(header, BCKZ_MAGIC, 4) != 0 || fields[0] != BCKZ_VERSION || fields[1] != BCKZ_BLOCK_SIZE ||
+        memcmp(trailer + 16, BCKZ_INDEX_MAGIC, 8) != 0 || index_at[0] > index_end ||
+        (index_end - index_at[0]) != index_at[1] * sizeof(IndexEntry)) {
+        return NULL;
+    }
+
+    BckzReader *r = calloc(1, sizeof(BckzReader));
+    if (!r) return NULL;
+    r->fd = fd;
+    r->num_blocks = (size_t)index_at[1];
+    r->index = malloc(r->num_blocks * sizeof(IndexEntry) + 1);
+    r->packed = malloc(BCKZ_BLOCK_SIZE);
+    if (!r->index || !r->packed || read_at(fd, r->index, r->num_blocks * sizeof(IndexEntry), index_at[0]) != 0) {
+        bckz_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+size_t bckz_num_blocks(const BckzReader *r) {
+    return r->num_blocks;
+}
+
+int bckz_read_block(BckzReader *r, size_t block, char *out, size_t *len) {
+    if (block >= r->num_blocks) return 1;
+    IndexEntry *entry = &r->index[block];
+    uint8_t header[BLOCK_HEADER_SIZE];
+    uint32_t lengths[2];
+    if (entry->raw_len > BCKZ_BLOCK_SIZE || entry->stored_len > BCKZ_BLOCK_SIZE ||
+        read_at(r->fd, header, sizeof(header), entry->offset) != 0) {
+        return 1;
+    }
+    memcpy(lengths, header + 1, sizeof(lengths));
+    if (lengths[0] != entry->raw_len || lengths[1] != entry->stored_len) return 1;
+
+    uint8_t *dst = (uint8_t *)out;
+    uint8_t *src = header[0] == CODEC_RAW ? dst : r->packed;
+    if (read_at(r->fd, src, entry->stored_len, entry->offset + BLOCK_HEADER_SIZE) != 0) return 1;
+    *len = entry->raw_len;
+    switch (header[0]) {
+    case CODEC_RAW:
+        return entry->stored_len != entry->raw_len;
+    case CODEC_LZ:
+        return lz_decompress(src, entry->stored_len, dst, entry->raw_len);
+    case CODEC_LZ4:
+#ifdef KVS_HAVE_LZ4
+        return LZ4_decompress_safe((const char *)src, out, (int)entry->stored_len, (int)entry->raw_len) !=
+               (int)entry->raw_len;
+#else
+        fprintf(stderr, "Backup block compressed with LZ4, which this build does not support\n");
+        return 1;
+#endif
+    default:
+        return 1;
+    }
+}
+
+void bckz_reader_close(BckzReader *r) {
+    if (!r) return;
+    free(r->index);
+    free(r->packed);
+    free(r);
+}
+
+int bckz_extract(int in_fd, int out_fd) {
+    BckzReader *r = bckz_reader_open(in_fd);
+    if (!r) {
+        fprintf(stderr, "Not a compressed backup\n");
+        return 1;
+    }
+    char *block = malloc(BCKZ_BLOCK_SIZE);
+    int result = block == NULL;
+    for (size_t i = 0; !result && i < r->num_blocks; i++) {
+        size_t len;
+        if (bckz_read_block(r, i, block, &len) != 0) {
+            fprintf(stderr, "Compressed backup corrupted at block %zu\n", i);
+            result = 1;
+        } else if (write_all(out_fd, block, len) != 0) {
+            perror("Error writing output");
+            result = 1;
+        }
+    }
+    free(block);
+    bckz_reader_close(r);
+    return result;
+}
+
+void bckz_stats(uint64_t *raw, uint64_t *stored) {
+    *raw = atomic_load(&raw_bytes);
+    *stored = atomic_load(&stored_bytes);
+}
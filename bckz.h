@@ -0,0 +1,82 @@
+#ifndef KVS_BCKZ_H
+#define KVS_BCKZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Compressed backup files. The dump is cut into blocks that are compressed
+/// independently, in parallel, and written in order. A footer indexes the
+/// blocks, so any one of them can be read without the ones before it.
+///
+/// Layout: header "KVSZ", version and block size; then each block as codec,
+/// raw length and stored length followed by its bytes; then the index (file
+/// offset, raw and stored length per block); then the index offset, the
+/// number of blocks and "KVSZIDX1". Integers are in host byte order.
+
+#define BCKZ_BLOCK_SIZE (64u << 10)  // Raw bytes per block
+#define BCKZ_MAX_THREADS 8u
+
+typedef struct BckzWriter BckzWriter;
+typedef struct BckzReader BckzReader;
+
+/// Writes part of the compressed file.
+/// @param fd File descriptor given to bckz_open.
+/// @param data Bytes to write.
+/// @param len Number of bytes.
+/// @return 0 on success, 1 otherwise.
+typedef int (*bckz_output)(int fd, const void *data, size_t len);
+
+/// Starts a compressed file. Compression threads are only started once
+/// the data outgrows one block.
+/// @param fd File descriptor to write to, at the start of the file.
+/// @param threads Blocks compressed at once, 0 to compress in the caller.
+/// @param output Function that writes to fd, NULL for plain writes.
+/// @return Newly created writer, NULL on failure.
+BckzWriter *bckz_open(int fd, unsigned int threads, bckz_output output);
+
+/// Appends data to the file.
+/// @param w Writer to append to.
+/// @param data Bytes to append.
+/// @param len Number of bytes.
+/// @return 0 on success, 1 if the file could not be written.
+int bckz_write(BckzWriter *w, const char *data, size_t len);
+
+/// Compresses what is left, writes the index and frees the writer. The file
+/// descriptor is left open.
+/// @param w Writer to close.
+/// @return 0 on success, 1 if any part of the file could not be written.
+int bckz_close(BckzWriter *w);
+
+/// Opens a compressed file for reading by loading its index.
+/// @param fd File descriptor to read from; only positioned reads are used.
+/// @return Newly created reader, NULL if the file is not a valid compressed backup.
+BckzReader *bckz_reader_open(int fd);
+
+/// @param r Reader to inspect.
+/// @return Number of blocks in the file.
+size_t bckz_num_blocks(const BckzReader *r);
+
+/// Reads and decompresses one block.
+/// @param r Reader to read from.
+/// @param block Index of the block.
+/// @param out Where to store the block, BCKZ_BLOCK_SIZE bytes.
+/// @param len Where to store the number of bytes in the block.
+/// @return 0 on success, 1 if the block is corrupted.
+int bckz_read_block(BckzReader *r, size_t block, char *out, size_t *len);
+
+/// Frees the reader. The file descriptor is left open.
+/// @param r Reader to free.
+void bckz_reader_close(BckzReader *r);
+
+/// Writes the decompressed contents of a compressed file.
+/// @param in_fd Compressed file.
+/// @param out_fd Where to write the contents.
+/// @return 0 on success, 1 otherwise.
+int bckz_extract(int in_fd, int out_fd);
+
+/// Reads how much backup data has been compressed so far.
+/// @param raw Where to store the bytes before compression.
+/// @param stored Where to store the bytes written, headers and index included.
+void bckz_stats(uint64_t *raw, uint64_t *stored);
+
+#endif  // KVS_BCKZ_H
@@ -0,0 +1,104 @@
+#include "filter.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define COUNTERS_PER_KEY 10  // ~1% false positives with the hash count below
+#define NUM_HASHES 7
+#define COUNTER_MAX 255      // Saturated counters are never decremented
+
+// FNV-1a followed by a 64 bit finalizer so that both halves are usable.
+static uint64_t key_hash(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// Double hashing: probe i is h1 + i * h2.
+static size_t probe(const CountingFilter *filter, uint64_t h, unsigned int i) {
+    uint64_t h1 = h & 0xffffffffu, h2 = (h >> 32) | 1u;
+    return (size_t)(h1 + i * h2) & (filter->num_counters - 1);
+}
+
+CountingFilter *filter_create(size_t capacity) {
+    size_t num_counters = 64;
+    while (num_counters < capacity * COUNTERS_PER_KEY)
+        num_counters <<= 1;
+
+    CountingFilter *filter = malloc(sizeof(CountingFilter) + num_counters * sizeof(atomic_uchar));
+    if (!filter)
+        return NULL;
+    filter->capacity = capacity;
+    filter->num_counters = num_counters;
+    filter->num_hashes = NUM_HASHES;
+    filter->retired = NULL;
+    for (size_t i = 0; i < num_counters; i++)
+        atomic_init(&filter->counters[i], 0);
+    return filter;
+}
+
+void filter_add(CountingFilter *filter, const char *key) {
+    uint64_t h = key_hash(key);
+    for (unsigned int i = 0; i < filter->num_hashes; i++) {
+        atomic_uchar *counter = &filter->counters[probe(filter, h, i)];
+        unsigned char c = atomic_load_explicit(counter, memory_order_relaxed);
+        while (c < COUNTER_MAX &&
+               !atomic_compare_exchange_weak_explicit(counter, &c, (unsigned char)(c + 1),
+                                                      memory_order_release, memory_order_relaxed))
+            ;
+    }
+}
+
+void filter_remove(CountingFilter *filter, const char *key) {
+    uint64_t h = key_hash(key);
+    for (unsigned int i = 0; i < filter->num_hashes; i++) {
+        atomic_uchar *counter = &filter->counters[probe(filter, h, i)];
+        unsigned char c = atomic_load_explicit(counter, memory_order_relaxed);
+        while (c > 0 && c < COUNTER_MAX &&
+               !atomic_compare_exchange_weak_explicit(counter, &c, (unsigned char)(c - 1),
+                                                      memory_order_release, memory_order_relaxed))
+            ;
+    }
+}
+
+int filter_maybe_contains(const CountingFilter *filter, const char *key) {
+    uint64_t h = key_hash(key);
+    for (unsigned int i = 0; i < filter->num_hashes; i++) {
+        if (atomic_load_explicit(&filter->counters[probe(filter, h, i)], memory_order_acquire) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+// base^exp by repeated squaring, avoids linking libm for one estimate.
+static double pow_uint(double base, size_t exp) {
+    double result = 1.0;
+    while (exp) {
+        if (exp & 1)
+            result *= base;
+        base *= base;
+        exp >>= 1;
+    }
+    return result;
+}
+
+double filter_expected_fpr(const CountingFilter *filter, size_t num_keys) {
+    double empty = pow_uint(1.0 - 1.0 / (double)filter->num_counters, num_keys * filter->num_hashes);
+    return pow_uint(1.0 - empty, filter->num_hashes);
+}
+
+void filter_free(CountingFilter *filter) {
+    while (filter) {
+        CountingFilter *retired = filter->retired;
+        free(filter);
+        filter = retired;
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef KVS_FILTER_H
+#define KVS_FILTER_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/// Counting Bloom filter. Answers "definitely absent" or "maybe present" and,
+/// unlike a plain Bloom filter, supports removals. Lookups, insertions and
+/// removals are lock free.
+typedef struct CountingFilter {
+    size_t capacity;              // Number of keys it was sized for
+    size_t num_counters;          // Power of two
+    unsigned int num_hashes;
+    struct CountingFilter *retired;  // Previous filters, freed with this one
+    atomic_uchar counters[];
+} CountingFilter;
+
+/// Creates an empty filter.
+/// @param capacity Expected number of keys.
+/// @return Newly created filter, NULL on failure.
+CountingFilter *filter_create(size_t capacity);
+
+/// Adds a key to the filter.
+/// @param filter Filter to modify.
+/// @param key Key to add.
+void filter_add(CountingFilter *filter, const char *key);
+
+/// Removes a key that was previously added.
+/// @param filter Filter to modify.
+/// @param key Key to remove.
+void filter_remove(CountingFilter *filter, const char *key);
+
+/// Tests whether a key may be present.
+/// @param filter Filter to query.
+/// @param key Key to look for.
+/// @return 0 if the key is definitely absent, 1 if it may be present.
+int filter_maybe_contains(const CountingFilter *filter, const char *key);
+
+/// Estimates the false positive rate for a number of stored keys.
+/// @param filter Filter to inspect.
+/// @param num_keys Number of keys currently stored.
+/// @return Expected false positive probability.
+double filter_expected_fpr(const CountingFilter *filter, size_t num_keys);
+
+/// Frees a filter and every filter it retired.
+/// @param filter Filter to free.
+void filter_free(CountingFilter *filter);
+
+#endif  // KVS_FILTER_H
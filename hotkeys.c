@@ -0,0 +1,211 @@
+#define _GNU_SOURCE  // sched_getcpu
+#include "hotkeys.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HOT_SLOTS 64       // Per slice, power of two
+#define HOT_MAX_SLICES 64
+#define HOT_WORDS (HOT_STRING_SIZE / 8)
+#define CACHE_LINE 64
+
+// Strings are stored NUL padded in atomic words so that a reader racing a
+// writer reads stale words, never torn bytes; the sequence tells it apart.
+typedef struct HotEntry {
+    _Alignas(CACHE_LINE) atomic_uint seq;  // Odd while a writer owns the entry
+    _Atomic uint64_t key[HOT_WORDS];       // All zero when the entry is empty
+    _Atomic uint64_t value[HOT_WORDS];
+} HotEntry;
+
+typedef struct HotSlice {
+    HotEntry entries[HOT_SLOTS];
+    _Alignas(CACHE_LINE) atomic_size_t hits;
+} HotSlice;
+
+struct HotCache {
+    unsigned int num_slices;
+    atomic_size_t promotions;
+    HotSlice *slices;
+};
+
+HotCache *hot_create() {
+    HotCache *cache = malloc(sizeof(HotCache));
+    if (!cache) return NULL;
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    cache->num_slices = cpus < 1 ? 1u : cpus > HOT_MAX_SLICES ? HOT_MAX_SLICES : (unsigned int)cpus;
+    cache->slices = aligned_alloc(CACHE_LINE, sizeof(HotSlice) * cache->num_slices);
+    if (!cache->slices) {
+        free(cache);
+        return NULL;
+    }
+    for (unsigned int s = 0; s < cache->num_slices; s++) {
+        HotSlice *slice = &cache->slices[s];
+        for (size_t i = 0; i < HOT_SLOTS; i++) {
+            atomic_init(&slice->entries[i].seq, 0);
+            for (size_t w = 0; w < HOT_WORDS; w++) {
+                atomic_init(&slice->entries[i].key[w], 0);
+                atomic_init(&slice->entries[i].value[w], 0);
+            }
+        }
+        atomic_init(&slice->hits, 0);
+    }
+    atomic_init(&cache->promotions, 0);
+    return cache;
+}
+
+// Packs a string into NUL padded words. Fails if it does not fit.
+static int pack(const char *str, uint64_t words[HOT_WORDS]) {
+    size_t len = strlen(str);
+    if (len >= HOT_STRING_SIZE) return 1;
+    memset(words, 0, HOT_STRING_SIZE);
+    memcpy(words, str, len);
+    return 0;
+}
+
+static size_t slot_of(const uint64_t key[HOT_WORDS]) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t w = 0; w < HOT_WORDS && key[w]; w++) {
+        h ^= key[w];
+        h *= 0x100000001b3ull;
+    }
+    h ^= h >> 29;
+    return (size_t)h & (HOT_SLOTS - 1);
+}
+
+static HotSlice *local_slice(HotCache *cache) {
+    static _Thread_local unsigned int fallback = 0;
+    int cpu = sched_getcpu();
+    if (cpu < 0) {
+        // No CPU number: spread threads by their address instead
+        cpu = (int)(((uintptr_t)&fallback >> 6) & 0x7fff);
+    }
+    return &cache->slices[(unsigned int)cpu % cache->num_slices];
+}
+
+static int key_matches(HotEntry *entry, const uint64_t key[HOT_WORDS]) {
+    for (size_t w = 0; w < HOT_WORDS; w++) {
+        if (atomic_load_explicit(&entry->key[w], memory_order_relaxed) != key[w]) return 0;
+    }
+    return 1;
+}
+
+int hot_lookup(HotCache *cache, const char *key, char *value) {
+    uint64_t packed[HOT_WORDS], copy[HOT_WORDS];
+    if (pack(key, packed) != 0) return 0;
+    HotSlice *slice = local_slice(cache);
+    HotEntry *entry = &slice->entries[slot_of(packed)];
+
+    unsigned int seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+    if (seq & 1u || !key_matches(entry, packed)) return 0;
+    for (size_t w = 0; w < HOT_WORDS; w++) {
+        copy[w] = atomic_load_explicit(&entry->value[w], memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq) return 0;
+
+    memcpy(value, copy, HOT_STRING_SIZE);
+    value[HOT_STRING_SIZE - 1] = '\0';
+    atomic_fetch_add_explicit(&slice->hits, 1, memory_order_relaxed);
+    return 1;
+}
+
+// Takes the entry for writing. Writers of different keys may share a slot.
+static void entry_lock(HotEntry *entry) {
+    unsigned int seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+    for (;;) {
+        if (seq & 1u) {
+            seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&entry->seq, &seq, seq + 1, memory_order_acquire,
+                                                  memory_order_relaxed)) {
+            break;
+        }
+    }
+    atomic_thread_fence(memory_order_release);
+}
+
+static void entry_unlock(HotEntry *entry) {
+    atomic_fetch_add_explicit(&entry->seq, 1, memory_order_release);
+}
+
+static void entry_store(_Atomic uint64_t *dest, const uint64_t src[HOT_WORDS]) {
+    for (size_t w = 0; w < HOT_WORDS; w++) {
+        atomic_store_explicit(&dest[w], src[w], memory_order_relaxed);
+    }
+}
+
+int hot_promote(HotCache *cache, const char *key, const char *value) {
+    uint64_t packed_key[HOT_WORDS], packed_value[HOT_WORDS];
+    if (pack(key, packed_key) != 0 || pack(value, packed_value) != 0) return 0;
+    size_t slot = slot_of(packed_key);
+    for (unsigned int s = 0; s < cache->num_slices; s++) {
+        HotEntry *entry = &cache->slices[s].entries[slot];
+        entry_lock(entry);
+        entry_store(entry->key, packed_key);
+        entry_store(entry->value, packed_value);
+        entry_unlock(entry);
+    }
+    atomic_fetch_add_explicit(&cache->promotions, 1, memory_order_relaxed);
+    return 1;
+}
+
+int hot_contains(HotCache *cache, const char *key) {
+    uint64_t packed[HOT_WORDS];
+    if (pack(key, packed) != 0) return 0;
+    size_t slot = slot_of(packed);
+    for (unsigned int s = 0; s < cache->num_slices; s++) {
+        HotEntry *entry = &cache->slices[s].entries[slot];
+        unsigned int seq;
+        int matches;
+        do {
+            seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+            matches = key_matches(entry, packed);
+            atomic_thread_fence(memory_order_acquire);
+        } while (seq & 1u || atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq);
+        if (matches) return 1;
+    }
+    return 0;
+}
+
+int hot_update(HotCache *cache, const char *key, const char *value) {
+    uint64_t packed_key[HOT_WORDS], packed_value[HOT_WORDS];
+    if (pack(key, packed_key) != 0) return 0;
+    // A value that does not fit drops the replicas instead
+    int drop = value == NULL || pack(value, packed_value) != 0;
+    static const uint64_t empty[HOT_WORDS] = {0};
+    size_t slot = slot_of(packed_key);
+    int present = 0;
+    for (unsigned int s = 0; s < cache->num_slices; s++) {
+        HotEntry *entry = &cache->slices[s].entries[slot];
+        if (!key_matches(entry, packed_key)) continue;  // Only this key's writers store it
+        entry_lock(entry);
+        if (key_matches(entry, packed_key)) {
+            if (drop) {
+                entry_store(entry->key, empty);
+            } else {
+                entry_store(entry->value, packed_value);
+                present = 1;
+            }
+        }
+        entry_unlock(entry);
+    }
+    return present;
+}
+
+void hot_stats(HotCache *cache, size_t *hits, size_t *promotions) {
+    *hits = 0;
+    for (unsigned int s = 0; s < cache->num_slices; s++) {
+        *hits += atomic_load_explicit(&cache->slices[s].hits, memory_order_relaxed);
+    }
+    *promotions = atomic_load(&cache->promotions);
+}
+
+void hot_free(HotCache *cache) {
+    if (!cache) return;
+    free(cache->slices);
+    free(cache);
+}
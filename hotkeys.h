@@ -0,0 +1,60 @@
+#ifndef KVS_HOTKEYS_H
+#define KVS_HOTKEYS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/// Per-CPU read replicas of hot keys. Every CPU has its own slice of
+/// entries, so reads of a hot key touch only cache lines local to the
+/// reading CPU. Each entry is a seqlock: readers never write shared memory,
+/// and a reader that races a writer falls back to the table instead of
+/// retrying. A key lives in the same slot of every slice.
+
+#define HOT_STRING_SIZE 48  // Keys and values must be shorter to be replicated
+
+typedef struct HotCache HotCache;
+
+/// Creates an empty cache with one slice per configured CPU.
+/// @return Newly created cache, NULL on failure.
+HotCache *hot_create();
+
+/// Looks up a replicated key in the calling CPU's slice.
+/// @param cache Cache to read.
+/// @param key Key to look up.
+/// @param value Where to copy the value, HOT_STRING_SIZE bytes.
+/// @return 1 if the key was found, 0 otherwise.
+int hot_lookup(HotCache *cache, const char *key, char *value);
+
+/// Replicates a key to every slice, replacing whatever key had its slot.
+/// The caller must keep writers of this key out while it runs.
+/// @param cache Cache to modify.
+/// @param key Key to replicate.
+/// @param value Current value of the key.
+/// @return 1 if the key was replicated, 0 if it is too long.
+int hot_promote(HotCache *cache, const char *key, const char *value);
+
+/// Checks whether a key still has its slot, in any slice.
+/// @param cache Cache to inspect.
+/// @param key Key to look for.
+/// @return 1 if some slice replicates the key, 0 otherwise.
+int hot_contains(HotCache *cache, const char *key);
+
+/// Brings the replicas of a key up to date. Must be called by the writer of
+/// the key, with writers of the key kept out.
+/// @param cache Cache to modify.
+/// @param key Key that changed.
+/// @param value New value, NULL to drop the replicas.
+/// @return 1 if some slice still replicates the key, 0 otherwise.
+int hot_update(HotCache *cache, const char *key, const char *value);
+
+/// Reads how many lookups were served by the replicas.
+/// @param cache Cache to inspect.
+/// @param hits Where to store the lookups served.
+/// @param promotions Where to store how many keys were replicated.
+void hot_stats(HotCache *cache, size_t *hits, size_t *promotions);
+
+/// Frees the cache.
+/// @param cache Cache to free.
+void hot_free(HotCache *cache);
+
+#endif  // KVS_HOTKEYS_H
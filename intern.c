@@ -0,0 +1,185 @@
+#include "intern.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERN_SHARDS 64          // Power of two
+#define INTERN_INITIAL_BUCKETS 64 // Per shard, power of two
+
+typedef struct InternEntry {
+    struct InternEntry *next;
+    uint64_t hash;
+    atomic_size_t refs;           // Only goes from 1 to 0 with the shard lock held
+    char value[];
+} InternEntry;
+
+typedef struct InternShard {
+    pthread_mutex_t lock;
+    InternEntry **buckets;
+    size_t num_buckets;           // Power of two
+    size_t count;
+    size_t bytes;
+} InternShard;
+
+struct InternTable {
+    InternShard shards[INTERN_SHARDS];
+};
+
+// FNV-1a followed by a 64 bit finalizer; the top bits pick the shard.
+static uint64_t value_hash(const char *value) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const unsigned char *p = (const unsigned char *)value; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+static InternShard *shard_of(InternTable *table, uint64_t hash) {
+    return &table->shards[hash >> 58 & (INTERN_SHARDS - 1)];
+}
+
+static size_t entry_bytes(const InternEntry *entry) {
+    return sizeof(InternEntry) + strlen(entry->value) + 1;
+}
+
+InternTable *intern_create() {
+    InternTable *table = malloc(sizeof(InternTable));
+    if (!table) return NULL;
+    for (size_t i = 0; i < INTERN_SHARDS; i++) {
+        InternShard *shard = &table->shards[i];
+        shard->buckets = calloc(INTERN_INITIAL_BUCKETS, sizeof(InternEntry *));
+        if (!shard->buckets) {
+            for (size_t j = 0; j < i; j++) {
+                pthread_mutex_destroy(&table->shards[j].lock);
+                free(table->shards[j].buckets);
+            }
+            free(table);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->num_buckets = INTERN_INITIAL_BUCKETS;
+        shard->count = 0;
+        shard->bytes = 0;
+    }
+    return table;
+}
+
+// Doubles the bucket array of a shard. Must be called with its lock held;
+// on allocation failure the shard keeps its longer chains.
+static void grow_shard(InternShard *shard) {
+    size_t num_buckets = shard->num_buckets * 2;
+    InternEntry **buckets = calloc(num_buckets, sizeof(InternEntry *));
+    if (!buckets) return;
+    for (size_t i = 0; i < shard->num_buckets; i++) {
+        InternEntry *entry = shard->buckets[i];
+        while (entry) {
+            InternEntry *next = entry->next;
+            size_t slot = entry->hash & (num_buckets - 1);
+            entry->next = buckets[slot];
+            buckets[slot] = entry;
+            entry = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->num_buckets = num_buckets;
+}
+
+char *intern_acquire(InternTable *table, const char *value, size_t *added) {
+    uint64_t hash = value_hash(value);
+    InternShard *shard = shard_of(table, hash);
+    *added = 0;
+    pthread_mutex_lock(&shard->lock);
+    InternEntry **slot = &shard->buckets[hash & (shard->num_buckets - 1)];
+    for (InternEntry *entry = *slot; entry; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->value, value) == 0) {
+            atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+            pthread_mutex_unlock(&shard->lock);
+            return entry->value;
+        }
+    }
+
+    size_t len = strlen(value) + 1;
+    InternEntry *entry = malloc(sizeof(InternEntry) + len);
+    if (!entry) {
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    memcpy(entry->value, value, len);
+    entry->hash = hash;
+    atomic_init(&entry->refs, 1);
+    entry->next = *slot;
+    *slot = entry;
+    shard->count++;
+    *added = entry_bytes(entry);
+    shard->bytes += *added;
+    if (shard->count > shard->num_buckets) grow_shard(shard);
+    pthread_mutex_unlock(&shard->lock);
+    return entry->value;
+}
+
+size_t intern_release(InternTable *table, char *value) {
+    InternEntry *entry = (InternEntry *)(void *)(value - offsetof(InternEntry, value));
+
+    // Not the last reference: no other thread can free the entry under us
+    size_t refs = atomic_load_explicit(&entry->refs, memory_order_relaxed);
+    while (refs > 1) {
+        if (atomic_compare_exchange_weak_explicit(&entry->refs, &refs, refs - 1,
+                                                  memory_order_release, memory_order_relaxed)) {
+            return 0;
+        }
+    }
+
+    // Possibly the last one: decide under the lock, where acquires happen
+    InternShard *shard = shard_of(table, entry->hash);
+    pthread_mutex_lock(&shard->lock);
+    if (atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) != 1) {
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+    InternEntry **link = &shard->buckets[entry->hash & (shard->num_buckets - 1)];
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+    size_t freed = entry_bytes(entry);
+    shard->count--;
+    shard->bytes -= freed;
+    pthread_mutex_unlock(&shard->lock);
+    free(entry);
+    return freed;
+}
+
+void intern_stats(InternTable *table, size_t *count, size_t *bytes) {
+    *count = *bytes = 0;
+    for (size_t i = 0; i < INTERN_SHARDS; i++) {
+        InternShard *shard = &table->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        *count += shard->count;
+        *bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void intern_free(InternTable *table) {
+    if (!table) return;
+    for (size_t i = 0; i < INTERN_SHARDS; i++) {
+        InternShard *shard = &table->shards[i];
+        for (size_t b = 0; b < shard->num_buckets; b++) {
+            InternEntry *entry = shard->buckets[b];
+            while (entry) {
+                InternEntry *next = entry->next;
+                free(entry);
+                entry = next;
+            }
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(table);
+}
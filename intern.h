@@ -0,0 +1,39 @@
+#ifndef KVS_INTERN_H
+#define KVS_INTERN_H
+
+#include <stddef.h>
+
+/// Refcounted table of shared strings. Equal values interned by any thread
+/// resolve to the same allocation, which stays alive until its last
+/// reference is released. The table is split into independently locked
+/// shards; releases that do not drop the last reference take no lock.
+typedef struct InternTable InternTable;
+
+/// Creates an empty table.
+/// @return Newly created table, NULL on failure.
+InternTable *intern_create();
+
+/// Takes a reference to the shared copy of a string, creating it if needed.
+/// @param table Table to intern into.
+/// @param value String to intern.
+/// @param added Where to store the bytes allocated, 0 if the string was shared.
+/// @return Shared copy of value, NULL on failure.
+char *intern_acquire(InternTable *table, const char *value, size_t *added);
+
+/// Drops a reference returned by intern_acquire.
+/// @param table Table the string belongs to.
+/// @param value Shared copy to release.
+/// @return Bytes freed, 0 if other references remain.
+size_t intern_release(InternTable *table, char *value);
+
+/// Counts the distinct strings held and the bytes they take.
+/// @param table Table to inspect.
+/// @param count Where to store the number of distinct strings.
+/// @param bytes Where to store the bytes allocated for them.
+void intern_stats(InternTable *table, size_t *count, size_t *bytes);
+
+/// Frees the table. Strings still referenced are freed too.
+/// @param table Table to free.
+void intern_free(InternTable *table);
+
+#endif  // KVS_INTERN_H
@@ -0,0 +1,291 @@
+#include "jobc.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define JOBC_MAGIC "KVSJOBC2"
+
+// Identifies the .job file the cache was built from by its metadata alone,
+// so a cache hit costs a stat instead of a read of the whole source
+typedef struct JobcHeader {
+    char magic[8];
+    uint64_t mtime_sec, mtime_nsec;
+    uint64_t size;
+    uint64_t dev, ino;
+    uint64_t records_hash;  // FNV-1a of the records, to catch a cache damaged in place
+} JobcHeader;
+
+static int buf_reserve(JobcBuffer *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return 0;
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + extra) cap *= 2;
+    uint8_t *data = realloc(buf->data, cap);
+    if (!data) return 1;
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+static void put(JobcBuffer *buf, const void *bytes, size_t len) {
+    memcpy(buf->data + buf->len, bytes, len);
+    buf->len += len;
+}
+
+static void put_u8(JobcBuffer *buf, uint8_t value) { put(buf, &value, 1); }
+static void put_u16(JobcBuffer *buf, uint16_t value) { put(buf, &value, 2); }
+static void put_u32(JobcBuffer *buf, uint32_t value) { put(buf, &value, 4); }
+
+static void put_str(JobcBuffer *buf, const char *str) {
+    size_t len = strlen(str);
+    put_u8(buf, (uint8_t)len);
+    put(buf, str, len + 1);
+}
+
+enum Command jobc_encode_next(int fd, JobcBuffer *buf) {
+    enum Command cmd;
+    while ((cmd = get_next(fd)) == CMD_EMPTY)
+        ;
+
+    // Worst case record: opcode, count, ttl and two length-prefixed strings per pair
+    if (buf_reserve(buf, 1 + 2 + 4 + MAX_WRITE_SIZE * 2 * (1 + MAX_STRING_SIZE)) != 0) {
+        return CMD_INVALID;
+    }
+    put_u8(buf, (uint8_t)cmd);
+
+    switch (cmd) {
+    case CMD_WRITE: {
+        char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0}, values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
+        unsigned int ttl_ms = 0;
+        size_t n = parse_write_ttl(fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE, &ttl_ms);
+        put_u16(buf, (uint16_t)n);
+        put_u32(buf, ttl_ms);
+        for (size_t i = 0; i < n; i++) {
+            put_str(buf, keys[i]);
+            put_str(buf, values[i]);
+        }
+        break;
+    }
+    case CMD_READ:
+    case CMD_DELETE: {
+        char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
+        size_t n = parse_read_delete(fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        put_u16(buf, (uint16_t)n);
+        for (size_t i = 0; i < n; i++) {
+            put_str(buf, keys[i]);
+        }
+        break;
+    }
+    case CMD_WAIT: {
+        unsigned int delay = 0, thread_id = 0;
+        int result = parse_wait(fd, &delay, &thread_id);
+        put_u8(buf, (uint8_t)(int8_t)result);
+        put_u32(buf, delay);
+        put_u32(buf, thread_id);
+        break;
+    }
+    case CMD_SHOW:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+    case EOC:
+        break;
+    }
+    return cmd;
+}
+
+// Reads a length-prefixed string, checking it fits in the buffer.
+static const uint8_t *get_str(const uint8_t *pc, const uint8_t *end, const char **str) {
+    if (pc >= end) return NULL;
+    size_t len = *pc++;
+    if (len >= MAX_STRING_SIZE || (size_t)(end - pc) < len + 1 || pc[len] != '\0') return NULL;
+    *str = (const char *)pc;
+    return pc + len + 1;
+}
+
+const uint8_t *jobc_decode(const uint8_t *pc, const uint8_t *end, JobCommand *cmd) {
+    if (pc >= end || *pc > EOC) return NULL;
+    cmd->cmd = (enum Command)*pc++;
+    cmd->num = 0;
+
+    switch (cmd->cmd) {
+    case CMD_WRITE:
+    case CMD_READ:
+    case CMD_DELETE: {
+        uint16_t n;
+        uint32_t ttl_ms = 0;
+        size_t fixed = cmd->cmd == CMD_WRITE ? 6 : 2;
+        if ((size_t)(end - pc) < fixed) return NULL;
+        memcpy(&n, pc, 2);
+        if (cmd->cmd == CMD_WRITE) memcpy(&ttl_ms, pc + 2, 4);
+        pc += fixed;
+        if (n > MAX_WRITE_SIZE) return NULL;
+        for (size_t i = 0; i < n; i++) {
+            if (!(pc = get_str(pc, end, &cmd->keys[i]))) return NULL;
+            if (cmd->cmd == CMD_WRITE && !(pc = get_str(pc, end, &cmd->values[i]))) return NULL;
+        }
+        cmd->num = n;
+        cmd->ttl_ms = ttl_ms;
+        break;
+    }
+    case CMD_WAIT: {
+        int8_t result;
+        if ((size_t)(end - pc) < 9) return NULL;
+        memcpy(&result, pc, 1);
+        memcpy(&cmd->delay_ms, pc + 1, 4);
+        memcpy(&cmd->thread_id, pc + 5, 4);
+        cmd->wait_result = result;
+        pc += 9;
+        break;
+    }
+    case CMD_SHOW:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+    case EOC:
+        break;
+    }
+    return pc;
+}
+
+static uint64_t hash_bytes(const uint8_t *bytes, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// Checks that every record decodes and that EOC ends the records.
+static int valid_records(const uint8_t *pc, const uint8_t *end) {
+    JobCommand cmd;
+    do {
+        if (!(pc = jobc_decode(pc, end, &cmd))) return 0;
+    } while (cmd.cmd != EOC);
+    return pc == end;
+}
+
+// Maps the cache if its header matches the source and its records are whole.
+static int load_cache(const char *cache_path, const JobcHeader *expected, JobcImage *image) {
+    int fd = open(cache_path, O_RDONLY);
+    if (fd == -1) return 1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size <= sizeof(JobcHeader)) {
+        close(fd);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 1;
+
+    const uint8_t *bytes = map;
+    const uint8_t *records = bytes + sizeof(JobcHeader);
+    JobcHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(&header, expected, offsetof(JobcHeader, records_hash)) != 0 ||
+        header.records_hash != hash_bytes(records, size - sizeof(JobcHeader)) ||
+        !valid_records(records, bytes + size)) {
+        munmap(map, size);
+        return 1;
+    }
+    image->data = records;
+    image->len = size - sizeof(JobcHeader);
+    image->mapped = 1;
+    return 0;
+}
+
+// Writes the cache through a temporary file so readers never see half of it.
+static void save_cache(const char *cache_path, const JobcHeader *header, const JobcBuffer *buf) {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache_path, (int)getpid()) >= (int)sizeof(tmp_path)) {
+        return;
+    }
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Error creating job cache");
+        return;
+    }
+    int ok = write(fd, header, sizeof(JobcHeader)) == (ssize_t)sizeof(JobcHeader) &&
+             write(fd, buf->data, buf->len) == (ssize_t)buf->len;
+    close(fd);
+    if (!ok || rename(tmp_path, cache_path) != 0) {
+        perror("Error writing job cache");
+        unlink(tmp_path);
+    }
+}
+
+int jobc_load(const char *job_path, JobcImage *image) {
+    char cache_path[PATH_MAX];
+    if (snprintf(cache_path, sizeof(cache_path), "%sc", job_path) >= (int)sizeof(cache_path)) {
+        return 1;
+    }
+    int fd = open(job_path, O_RDONLY);
+    if (fd == -1) return 1;
+
+    struct stat st;
+    JobcHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOBC_MAGIC, sizeof(header.magic));
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 1;
+    }
+    header.mtime_sec = (uint64_t)st.st_mtim.tv_sec;
+    header.mtime_nsec = (uint64_t)st.st_mtim.tv_nsec;
+    header.size = (uint64_t)st.st_size;
+    header.dev = (uint64_t)st.st_dev;
+    header.ino = (uint64_t)st.st_ino;
+
+    if (load_cache(cache_path, &header, image) == 0) {
+        close(fd);
+        return 0;
+    }
+
+    // Cache missing or stale: compile the job
+    JobcBuffer buf = {NULL, 0, 0};
+    enum Command cmd;
+    do {
+        size_t before = buf.len;
+        cmd = jobc_encode_next(fd, &buf);
+        if (buf.len == before) {
+            close(fd);
+            jobc_buffer_free(&buf);
+            return 1;
+        }
+    } while (cmd != EOC);
+    close(fd);
+
+    header.records_hash = hash_bytes(buf.data, buf.len);
+    save_cache(cache_path, &header, &buf);
+    image->data = buf.data;
+    image->len = buf.len;
+    image->mapped = 0;
+    return 0;
+}
+
+void jobc_release(JobcImage *image) {
+    if (image->data == NULL) return;
+    if (image->mapped) {
+        munmap((void *)(uintptr_t)(image->data - sizeof(JobcHeader)), image->len + sizeof(JobcHeader));
+    } else {
+        free((void *)(uintptr_t)image->data);
+    }
+    image->data = NULL;
+    image->len = 0;
+}
+
+void jobc_buffer_free(JobcBuffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
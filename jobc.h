@@ -0,0 +1,76 @@
+#ifndef KVS_JOBC_H
+#define KVS_JOBC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "parser.h"
+
+/// Compiled job format (.jobc). A header identifying the source .job file is
+/// followed by one record per command, each starting with its enum Command
+/// value as a byte:
+///   WRITE:        u16 count, u32 ttl_ms, count x (u8 len, key, '\0', u8 len, value, '\0')
+///   READ, DELETE: u16 count, count x (u8 len, key, '\0')
+///   WAIT:         i8 parse_wait result, u32 delay_ms, u32 thread_id
+///   others:       no payload
+/// A count of 0 records a command that failed to parse. Empty lines and
+/// comments are dropped and the stream ends with EOC. Integers use the host
+/// byte order: caches are not meant to be moved between machines.
+
+/// Growable byte buffer holding records.
+typedef struct JobcBuffer {
+    uint8_t *data;
+    size_t len, cap;
+} JobcBuffer;
+
+/// Loaded compiled job. Either owns a heap buffer or a read-only mapping.
+typedef struct JobcImage {
+    const uint8_t *data;
+    size_t len;
+    int mapped;
+} JobcImage;
+
+/// Decoded command. Strings point into the record they were decoded from.
+typedef struct JobCommand {
+    enum Command cmd;
+    size_t num;                          // Pairs or keys, 0 if parsing failed
+    const char *keys[MAX_WRITE_SIZE];
+    const char *values[MAX_WRITE_SIZE];
+    unsigned int ttl_ms;
+    int wait_result;                     // As returned by parse_wait
+    unsigned int delay_ms, thread_id;
+} JobCommand;
+
+/// Parses the next command of a text job and appends its record.
+/// Empty lines and comments are skipped.
+/// @param fd File descriptor of the .job file.
+/// @param buf Buffer to append to.
+/// @return The command encoded, CMD_INVALID with nothing appended if out of memory.
+enum Command jobc_encode_next(int fd, JobcBuffer *buf);
+
+/// Decodes the record at the start of a buffer.
+/// @param pc Start of the record.
+/// @param end End of the buffer.
+/// @param cmd Where to store the decoded command.
+/// @return Start of the next record, NULL if the record is truncated or invalid.
+const uint8_t *jobc_decode(const uint8_t *pc, const uint8_t *end, JobCommand *cmd);
+
+/// Loads the compiled form of a job. The cache next to the job (<job>c) is
+/// used if its recorded mtime, size, device and inode match the .job file
+/// and its records are intact; otherwise the job is compiled and the
+/// cache rewritten.
+/// @param job_path Path of the .job file.
+/// @param image Where to store the records, without the header.
+/// @return 0 if the job was loaded, 1 otherwise.
+int jobc_load(const char *job_path, JobcImage *image);
+
+/// Releases an image returned by jobc_load.
+/// @param image Image to release.
+void jobc_release(JobcImage *image);
+
+/// Frees the memory held by a buffer.
+/// @param buf Buffer to free.
+void jobc_buffer_free(JobcBuffer *buf);
+
+#endif  // KVS_JOBC_H
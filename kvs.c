@@ -2,6 +2,24 @@
 #include "string.h"
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
+#include "trace.h"
+
+#define FILTER_INITIAL_CAPACITY 1024
+#define EVICTION_LOW_WATERMARK(limit) ((limit) - (limit) / 20)  // Evict down to 95% of the cap
+#define SWEEP_BATCH 32  // Expired keys reclaimed per pass of the sweeper
+#define HOT_SAMPLE_MASK 15u  // One read in 16 is counted towards replication
+#define HOT_THRESHOLD 8u     // Sampled reads before a key is replicated
+#define READ_WINDOW 8        // Buckets whose chains read_pairs walks together
+
+// Pending expiry of a key. Entries are never updated: a key that was
+// rewritten or deleted since is simply skipped when its entry fires.
+typedef struct ExpiryEntry {
+    TimerNode timer;
+    char key[];
+} ExpiryEntry;
+
+static void *sweeper_func(void *arg);
 
 // Hash function based on key initial.
 // @param key Lowercase alphabetical string.
@@ -17,93 +35,924 @@ int hash(const char *key) {
     return -1; // Invalid index for non-alphabetic or number strings
 }
 
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Bucket locks are taken through these so that the time spent blocked on
+// them is measured, and traced as a span. Uncontended acquisitions cost a
+// single trylock.
+static void bucket_rdlock(HashTable *ht, int index) {
+    if (pthread_rwlock_tryrdlock(&ht->locks[index]) == 0) return;
+    uint64_t start = now_ns();
+    pthread_rwlock_rdlock(&ht->locks[index]);
+    atomic_fetch_add_explicit(&ht->lock_wait_ns, now_ns() - start, memory_order_relaxed);
+    TRACE_END("bucket_rdlock_wait", start, NULL);
+}
+
+static void bucket_wrlock(HashTable *ht, int index) {
+    if (pthread_rwlock_trywrlock(&ht->locks[index]) == 0) return;
+    uint64_t start = now_ns();
+    pthread_rwlock_wrlock(&ht->locks[index]);
+    atomic_fetch_add_explicit(&ht->lock_wait_ns, now_ns() - start, memory_order_relaxed);
+    TRACE_END("bucket_wrlock_wait", start, NULL);
+}
+
 
 struct HashTable* create_hash_table() {
   HashTable *ht = malloc(sizeof(HashTable));
   if (!ht) return NULL;
+  CountingFilter *filter = filter_create(FILTER_INITIAL_CAPACITY);
+  if (!filter) {
+      free(ht);
+      return NULL;
+  }
   for (int i = 0; i < TABLE_SIZE; i++) {
       ht->table[i] = NULL;
+      pthread_rwlock_init(&ht->locks[i], NULL);
   }
+  atomic_init(&ht->filter, filter);
+  atomic_init(&ht->num_keys, 0);
+  atomic_init(&ht->filter_resizing, 0);
+  atomic_init(&ht->filter_negatives, 0);
+  atomic_init(&ht->filter_false_positives, 0);
+  atomic_init(&ht->commit_counter, 0);
+  atomic_init(&ht->oldest_snapshot, NO_SNAPSHOT);
+  atomic_init(&ht->pinning, 0);
+  pthread_mutex_init(&ht->snapshot_lock, NULL);
+  ht->snapshots = NULL;
+  ht->num_snapshots = ht->snapshots_capacity = 0;
+  atomic_init(&ht->mem_used, 0);
+  atomic_init(&ht->mem_limit, 0);
+  atomic_init(&ht->evictions, 0);
+  pthread_mutex_init(&ht->evict_lock, NULL);
+  ht->evict_snapshots = NULL;
+  ht->evict_snapshots_capacity = 0;
+  pthread_mutex_init(&ht->hot_lock, NULL);
+  ht->clock_hand = 0;
+  ht->clock_pos = 0;
+  atomic_init(&ht->expirations, 0);
+  atomic_init(&ht->lock_wait_ns, 0);
+  ht->on_commit = NULL;
+  ht->after_commit = NULL;
+  ht->hook_arg = NULL;
+  ht->values = NULL;
+  ht->hot = NULL;
+  ht->sweeper_stopping = 0;
+  tw_init(&ht->ttl_wheel, monotonic_ms());
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ht->ttl_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&ht->ttl_lock, NULL);
+  ht->sweeper_started = 0;
   return ht;
 }
 
+static int node_is_live(const KeyNode *node) {
+    return node->versions->value != NULL;
+}
+
+// Bytes charged to the memory budget for a node without its versions. A
+// version is charged its own size plus its value, unless the value is
+// interned: shared values are charged once, when first interned.
+static size_t node_bytes(const KeyNode *node) {
+    return sizeof(KeyNode) + strlen(node->key) + 1;
+}
+
+static Version *new_version(HashTable *ht, const char *value, uint64_t commit, uint64_t expires_at, Version *older) {
+    Version *version = malloc(sizeof(Version));
+    if (!version) return NULL;
+    size_t value_bytes = 0;
+    version->value = NULL;
+    if (value) {
+        if (ht->values) {
+            version->value = intern_acquire(ht->values, value, &value_bytes);
+        } else if ((version->value = strdup(value)) != NULL) {
+            value_bytes = strlen(value) + 1;
+        }
+        if (!version->value) {
+            free(version);
+            return NULL;
+        }
+    }
+    version->commit = commit;
+    version->expires_at = expires_at;
+    version->older = older;
+    atomic_fetch_add_explicit(&ht->mem_used, sizeof(Version) + value_bytes, memory_order_relaxed);
+    return version;
+}
+
+static void free_version(HashTable *ht, Version *version) {
+    size_t value_bytes = 0;
+    if (version->value && ht->values) {
+        value_bytes = intern_release(ht->values, version->value);
+    } else if (version->value) {
+        value_bytes = strlen(version->value) + 1;
+        free(version->value);
+    }
+    atomic_fetch_sub_explicit(&ht->mem_used, sizeof(Version) + value_bytes, memory_order_relaxed);
+    free(version);
+}
+
+// Checks the expiry of a version. The clock is only read for versions that
+// have a TTL, and at most once per *now.
+static int version_expired(const Version *version, uint64_t *now) {
+    if (version->expires_at == 0) return 0;
+    if (*now == 0) *now = monotonic_ms();
+    return version->expires_at <= *now;
+}
+
+static uint64_t next_commit(HashTable *ht) {
+    return atomic_fetch_add(&ht->commit_counter, 1) + 1;
+}
+
+// Stamps a write or delete and returns the horizon it may collect up to:
+// versions superseded at or before it can no longer be read by any snapshot.
+// Must be called with the bucket write lock held. The stamp is taken before
+// the snapshots are looked at, so a snapshot pinned after that includes the
+// commit and needs nothing it collects. While a snapshot is being pinned its
+// version is not known yet, so nothing is collected.
+static uint64_t begin_commit(HashTable *ht, uint64_t *commit) {
+    *commit = next_commit(ht);
+    if (atomic_load(&ht->pinning) != 0) return 0;
+    return atomic_load(&ht->oldest_snapshot);
+}
+
+// Frees the versions older than the newest one visible at the horizon.
+static void trim_versions(HashTable *ht, KeyNode *node, uint64_t horizon) {
+    Version *version = node->versions;
+    while (version != NULL && version->commit > horizon) {
+        version = version->older;
+    }
+    if (version == NULL) return;
+    Version *old = version->older;
+    version->older = NULL;
+    while (old != NULL) {
+        Version *temp = old;
+        old = old->older;
+        free_version(ht, temp);
+    }
+}
+
+// A deleted node can go once no snapshot predates its deletion.
+static int node_is_dead(const KeyNode *node, uint64_t horizon) {
+    return !node_is_live(node) && node->versions->commit <= horizon;
+}
+
+static void free_node(HashTable *ht, KeyNode *node) {
+    Version *version = node->versions;
+    while (version != NULL) {
+        Version *temp = version;
+        version = version->older;
+        free_version(ht, temp);
+    }
+    atomic_fetch_sub_explicit(&ht->mem_used, node_bytes(node), memory_order_relaxed);
+    free(node->key);
+    free(node);
+}
+
+// Removes the live node *link points to. If a snapshot may still read it the
+// deletion is recorded as a version, otherwise the node is unlinked and freed.
+// Deletes, expirations and evictions all go through here, and all of them are
+// reported to the commit hook.
+// Must be called with the bucket write lock held, with the commit and horizon
+// given by begin_commit.
+// @return 1 if the node was unlinked, 0 if it stays in the chain, -1 on failure.
+static int retire_node(HashTable *ht, KeyNode **link, uint64_t commit, uint64_t horizon) {
+    KeyNode *keyNode = *link;
+    int unlinked = 0;
+    if (horizon != NO_SNAPSHOT) {
+        // A snapshot may still read this key: record the deletion instead
+        Version *tombstone = new_version(ht, NULL, commit, 0, keyNode->versions);
+        if (tombstone == NULL) return -1;
+        keyNode->versions = tombstone;
+        trim_versions(ht, keyNode, horizon);
+    } else {
+        *link = keyNode->next; // Bypass the node
+        unlinked = 1;
+    }
+    filter_remove(atomic_load(&ht->filter), keyNode->key);
+    atomic_fetch_sub(&ht->num_keys, 1);
+    if (ht->on_commit) ht->on_commit(ht->hook_arg, 1, keyNode->key, NULL, 0);
+    if (atomic_load_explicit(&keyNode->hot, memory_order_relaxed)) {
+        hot_update(ht->hot, keyNode->key, NULL);
+        atomic_store_explicit(&keyNode->hot, 0, memory_order_relaxed);
+    }
+    if (unlinked) {
+        // Free the memory allocated for the key, its values and the node itself
+        free_node(ht, keyNode);
+    }
+    return unlinked;
+}
+
+// Clears the hot flag of a key whose slot another key has taken. Its writers
+// must be kept out, and so must other promotions unless hot_lock is held.
+// @return 1 if the key is still replicated.
+static int still_hot(HashTable *ht, KeyNode *keyNode) {
+    if (!atomic_load_explicit(&keyNode->hot, memory_order_relaxed)) return 0;
+    if (hot_contains(ht->hot, keyNode->key)) return 1;
+    atomic_store_explicit(&keyNode->hot, 0, memory_order_relaxed);
+    return 0;
+}
+
+// Checks a key's hot flag with its bucket write lock held, which keeps out
+// both its writers and its readers, the only ones that promote it.
+static int hot_kept(HashTable *ht, KeyNode *node) {
+    return ht->hot && still_hot(ht, node);
+}
+
+static int compare_snapshots(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Copies the pinned snapshots into evict_snapshots, sorted. Must be called
+// with evict_lock and a bucket write lock held, after begin_commit: snapshots
+// pinned later include the commit and can only read the newest versions.
+// @return Number of snapshots, or -1 if out of memory.
+static long copy_snapshots(HashTable *ht) {
+    pthread_mutex_lock(&ht->snapshot_lock);
+    size_t count = ht->num_snapshots;
+    if (count > ht->evict_snapshots_capacity) {
+        uint64_t *grown = realloc(ht->evict_snapshots, count * sizeof(uint64_t));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&ht->snapshot_lock);
+            return -1;
+        }
+        ht->evict_snapshots = grown;
+        ht->evict_snapshots_capacity = count;
+    }
+    if (count > 0) memcpy(ht->evict_snapshots, ht->snapshots, count * sizeof(uint64_t));
+    pthread_mutex_unlock(&ht->snapshot_lock);
+    qsort(ht->evict_snapshots, count, sizeof(uint64_t), compare_snapshots);
+    return (long)count;
+}
+
+// Frees the versions of a node that none of the sorted snapshots reads: a
+// snapshot reads the newest version committed at or before it, so an older
+// version is kept only if a snapshot falls between its commit and the one of
+// the version that replaced it. The newest version is always kept.
+static void trim_unread_versions(HashTable *ht, KeyNode *node, const uint64_t *snapshots, size_t count) {
+    Version *kept = node->versions;
+    uint64_t replaced_at = kept->commit;
+    size_t next = count;  // Snapshots at or after replaced_at are already served
+    while (kept->older != NULL) {
+        Version *version = kept->older;
+        while (next > 0 && snapshots[next - 1] >= replaced_at) next--;
+        replaced_at = version->commit;
+        if (next > 0 && snapshots[next - 1] >= version->commit) {
+            kept = version;
+        } else {
+            kept->older = version->older;
+            free_version(ht, version);
+        }
+    }
+}
+
+// CLOCK eviction: the hand sweeps the buckets, giving recently read keys a
+// second chance and removing the first cold ones it finds until usage is back
+// under the low watermark. Versions no snapshot needs are freed on the way, and
+// so are deleted nodes. While snapshots are pinned only what they cannot read
+// goes: versions between the ones they read, and the current value of cold
+// keys written after the newest of them, which leaves a tombstone. Keys a
+// snapshot still reads stay until it is released. Only one thread evicts at a
+// time; others carry on over the cap rather than queue behind it. Readers never
+// take part.
+static void evict(HashTable *ht) {
+    size_t limit = atomic_load_explicit(&ht->mem_limit, memory_order_relaxed);
+    if (limit == 0 || atomic_load_explicit(&ht->mem_used, memory_order_relaxed) <= limit ||
+        pthread_mutex_trylock(&ht->evict_lock) != 0) {
+        return;
+    }
+
+    size_t target = EVICTION_LOW_WATERMARK(limit);
+    uint64_t now = 0;
+    int evicted = 0;
+    // Two turns of the hand: the first one may only clear reference bits
+    for (int step = 0; step <= 2 * TABLE_SIZE && atomic_load(&ht->mem_used) > target; step++) {
+        int index = ht->clock_hand;
+        bucket_wrlock(ht, index);
+        uint64_t commit, horizon = begin_commit(ht, &commit);
+        long num_snapshots = horizon == NO_SNAPSHOT ? 0 : copy_snapshots(ht);
+        if (horizon == 0 || num_snapshots < 0) {
+            // A snapshot is being pinned: try again on the next write
+            pthread_rwlock_unlock(&ht->locks[index]);
+            break;
+        }
+        const uint64_t *snapshots = ht->evict_snapshots;
+        size_t count = (size_t)num_snapshots;
+        uint64_t newest = count > 0 ? snapshots[count - 1] : 0;
+        KeyNode **link = &ht->table[index];
+        size_t pos = 0;
+        while (*link != NULL && atomic_load(&ht->mem_used) > target) {
+            KeyNode *node = *link;
+            if (pos < ht->clock_pos) {
+                pos++;
+                link = &node->next;
+                continue;
+            }
+            // A deletion left with nothing older reads as missing to everyone
+            trim_unread_versions(ht, node, snapshots, count);
+            if (!node_is_live(node) && node->versions->older == NULL) {
+                *link = node->next;
+                free_node(ht, node);
+                continue;
+            }
+            pos++;
+            // Reads served by replicas leave no reference bit: keys still
+            // replicated always get a second chance. A key whose current
+            // value a snapshot reads would only gain a tombstone.
+            if (atomic_load(&ht->mem_used) <= target || !node_is_live(node) || node->versions->commit <= newest ||
+                ((atomic_exchange_explicit(&node->referenced, 0, memory_order_relaxed) || hot_kept(ht, node)) &&
+                 !version_expired(node->versions, &now))) {
+                link = &node->next;
+                continue;
+            }
+            int unlinked = retire_node(ht, link, commit, horizon);
+            if (unlinked < 0) break;
+            evicted = 1;
+            atomic_fetch_add_explicit(&ht->evictions, 1, memory_order_relaxed);
+            if (unlinked) {
+                pos--;  // The next node moved into this position
+            } else {
+                trim_unread_versions(ht, node, snapshots, count);
+                link = &node->next;
+            }
+        }
+        if (*link == NULL) {
+            ht->clock_hand = (index + 1) % TABLE_SIZE;
+            ht->clock_pos = 0;
+        } else {
+            ht->clock_pos = pos;
+        }
+        pthread_rwlock_unlock(&ht->locks[index]);
+    }
+    pthread_mutex_unlock(&ht->evict_lock);
+    if (evicted && ht->after_commit) ht->after_commit(ht->hook_arg);
+}
+
+// Rebuilds the filter with twice the capacity once the table outgrows it.
+// Holds every bucket lock while copying, so writers always see the current
+// filter. Lock-free readers may still be probing the old one, which is why it
+// is retired instead of freed.
+static void grow_filter(HashTable *ht) {
+    CountingFilter *old = atomic_load(&ht->filter);
+    int expected = 0;
+    if (atomic_load_explicit(&ht->num_keys, memory_order_relaxed) <= old->capacity ||
+        !atomic_compare_exchange_strong(&ht->filter_resizing, &expected, 1)) {
+        return;
+    }
+
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        bucket_wrlock(ht, i);
+    }
+    old = atomic_load(&ht->filter);
+    size_t capacity = old->capacity;
+    while (capacity < atomic_load(&ht->num_keys)) {
+        capacity *= 2;
+    }
+    CountingFilter *filter = filter_create(capacity * 2);
+    if (filter) {
+        for (int i = 0; i < TABLE_SIZE; i++) {
+            for (KeyNode *node = ht->table[i]; node != NULL; node = node->next) {
+                if (node_is_live(node)) filter_add(filter, node->key);
+            }
+        }
+        filter->retired = old;
+        atomic_store(&ht->filter, filter);
+    }
+    for (int i = TABLE_SIZE - 1; i >= 0; i--) {
+        pthread_rwlock_unlock(&ht->locks[i]);
+    }
+    atomic_store(&ht->filter_resizing, 0);
+}
+
+// Arms the expiry of a key on the wheel and wakes the sweeper if it is now due
+// earlier. The sweeper is started by the first expiry, so tables that never see
+// a TTL have no thread for it.
+static void schedule_expiry(HashTable *ht, const char *key, uint64_t expires_at) {
+    size_t len = strlen(key) + 1;
+    ExpiryEntry *entry = malloc(sizeof(ExpiryEntry) + len);
+    if (entry == NULL) return;  // Still expires lazily when read
+    memcpy(entry->key, key, len);
+    pthread_mutex_lock(&ht->ttl_lock);
+    if (!ht->sweeper_started && !ht->sweeper_stopping) {
+        // Without the sweeper keys still expire lazily when read
+        if (pthread_create(&ht->sweeper, NULL, sweeper_func, ht) == 0) {
+            ht->sweeper_started = 1;
+        } else {
+            ht->sweeper_stopping = 1;
+        }
+    }
+    if (expires_at < tw_next_expiry(&ht->ttl_wheel)) {
+        pthread_cond_signal(&ht->ttl_cond);
+    }
+    tw_add(&ht->ttl_wheel, &entry->timer, expires_at);
+    pthread_mutex_unlock(&ht->ttl_lock);
+}
+
+// Reclaims a key whose entry fired, if it is still the expired value.
+static void expire_key(HashTable *ht, const char *key) {
+    int index = hash(key);
+    uint64_t now = 0;
+    int retired = 0;
+    bucket_wrlock(ht, index);
+    uint64_t commit, horizon = begin_commit(ht, &commit);
+    for (KeyNode **link = &ht->table[index]; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->key, key) == 0) {
+            if (node_is_live(*link) && version_expired((*link)->versions, &now) &&
+                retire_node(ht, link, commit, horizon) >= 0) {
+                atomic_fetch_add_explicit(&ht->expirations, 1, memory_order_relaxed);
+                retired = 1;
+            }
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&ht->locks[index]);
+    if (retired && ht->after_commit) ht->after_commit(ht->hook_arg);
+}
+
+// Background sweeper: reclaims expired keys a small batch at a time, never
+// holding the wheel lock while it takes bucket locks.
+static void *sweeper_func(void *arg) {
+    HashTable *ht = arg;
+    pthread_mutex_lock(&ht->ttl_lock);
+    while (!ht->sweeper_stopping) {
+        TimerNode *expired = tw_advance(&ht->ttl_wheel, monotonic_ms(), SWEEP_BATCH);
+        if (expired == NULL) {
+            uint64_t next = tw_next_expiry(&ht->ttl_wheel);
+            if (next == UINT64_MAX) {
+                pthread_cond_wait(&ht->ttl_cond, &ht->ttl_lock);
+            } else {
+                struct timespec ts = {(time_t)(next / 1000u), (long)(next % 1000u) * 1000000L};
+                pthread_cond_timedwait(&ht->ttl_cond, &ht->ttl_lock, &ts);
+            }
+            continue;
+        }
+
+        pthread_mutex_unlock(&ht->ttl_lock);
+        while (expired != NULL) {
+            ExpiryEntry *entry = TW_CONTAINER_OF(expired, ExpiryEntry, timer);
+            expired = expired->next;
+            expire_key(ht, entry->key);
+            free(entry);
+        }
+        pthread_mutex_lock(&ht->ttl_lock);
+    }
+    pthread_mutex_unlock(&ht->ttl_lock);
+    return NULL;
+}
+
 int write_pair(HashTable *ht, const char *key, const char *value) {
+    return write_pair_ttl(ht, key, value, 0);
+}
+
+int write_pair_ttl(HashTable *ht, const char *key, const char *value, unsigned int ttl_ms) {
+    return write_pair_expiring(ht, key, value, ttl_ms ? monotonic_ms() + ttl_ms : 0);
+}
+
+int write_pair_expiring(HashTable *ht, const char *key, const char *value, uint64_t expires_at) {
     int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
+    bucket_wrlock(ht, index);
+    uint64_t commit, horizon = begin_commit(ht, &commit);
+    KeyNode **link = &ht->table[index];
+    KeyNode *keyNode = *link;
 
-    // Search for the key node
+    // Search for the key node, dropping deleted nodes that no snapshot needs
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            free(keyNode->value);
-            keyNode->value = strdup(value);
+        if (node_is_dead(keyNode, horizon)) {
+            *link = keyNode->next;
+            free_node(ht, keyNode);
+            keyNode = *link;
+            continue;
+        }
+        if (strcmp(keyNode->key, key) == 0 && node_is_live(keyNode)) {
+            Version *version = new_version(ht, value, commit, expires_at, keyNode->versions);
+            if (version == NULL) {
+                pthread_rwlock_unlock(&ht->locks[index]);
+                return 1;
+            }
+            keyNode->versions = version;
+            trim_versions(ht, keyNode, horizon);
+            // Replicas cannot expire, so a value with a TTL drops them
+            if (atomic_load_explicit(&keyNode->hot, memory_order_relaxed) &&
+                !hot_update(ht->hot, key, expires_at ? NULL : value)) {
+                atomic_store_explicit(&keyNode->hot, 0, memory_order_relaxed);
+            }
+            if (ht->on_commit) ht->on_commit(ht->hook_arg, 0, key, value, expires_at);
+            pthread_rwlock_unlock(&ht->locks[index]);
+            if (ht->after_commit) ht->after_commit(ht->hook_arg);
+            if (expires_at) schedule_expiry(ht, key, expires_at);
+            evict(ht);
             return 0;
         }
+        link = &keyNode->next;
         keyNode = keyNode->next; // Move to the next node
     }
 
     // Key not found, create a new key node
     keyNode = malloc(sizeof(KeyNode));
+    if (keyNode == NULL) {
+        pthread_rwlock_unlock(&ht->locks[index]);
+        return 1;
+    }
     keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
+    keyNode->versions = keyNode->key ? new_version(ht, value, commit, expires_at, NULL) : NULL; // Allocate memory for the value
+    if (keyNode->versions == NULL) {
+        free(keyNode->key);
+        free(keyNode);
+        pthread_rwlock_unlock(&ht->locks[index]);
+        return 1;
+    }
+    atomic_init(&keyNode->referenced, 1);
+    atomic_init(&keyNode->hot, 0);
+    atomic_init(&keyNode->hits, 0);
+    atomic_fetch_add_explicit(&ht->mem_used, node_bytes(keyNode), memory_order_relaxed);
     keyNode->next = ht->table[index]; // Link to existing nodes
     ht->table[index] = keyNode; // Place new key node at the start of the list
+    filter_add(atomic_load(&ht->filter), key);
+    atomic_fetch_add(&ht->num_keys, 1);
+    if (ht->on_commit) ht->on_commit(ht->hook_arg, 0, key, value, expires_at);
+    pthread_rwlock_unlock(&ht->locks[index]);
+
+    if (ht->after_commit) ht->after_commit(ht->hook_arg);
+    if (expires_at) schedule_expiry(ht, key, expires_at);
+    grow_filter(ht);
+    evict(ht);
     return 0;
 }
 
+// Counts a sampled read of a key and replicates it once it is hot. Called
+// with the bucket read lock held, which keeps the key's writers out. A hot
+// key only gets here when its replica missed, most likely because another
+// key took its slot, so the flag is checked again before it is trusted.
+static void note_read(HashTable *ht, KeyNode *keyNode) {
+    static _Thread_local unsigned int tick = 0;
+    if ((++tick & HOT_SAMPLE_MASK) != 0) return;
+    if (atomic_load_explicit(&keyNode->hot, memory_order_relaxed)) {
+        pthread_mutex_lock(&ht->hot_lock);
+        int hot = still_hot(ht, keyNode);
+        pthread_mutex_unlock(&ht->hot_lock);
+        if (hot) return;
+    }
+    if (atomic_fetch_add_explicit(&keyNode->hits, 1, memory_order_relaxed) + 1 < HOT_THRESHOLD) return;
+    atomic_store_explicit(&keyNode->hits, 0, memory_order_relaxed);
+    if (keyNode->versions->expires_at != 0) return;
+    // Readers of the same key may promote it at once; the lock keeps one of
+    // them from clearing the flag of a key another one just replicated
+    pthread_mutex_lock(&ht->hot_lock);
+    if (!atomic_load_explicit(&keyNode->hot, memory_order_relaxed) &&
+        hot_promote(ht->hot, keyNode->key, keyNode->versions->value)) {
+        atomic_store_explicit(&keyNode->hot, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&ht->hot_lock);
+}
+
 char* read_pair(HashTable *ht, const char *key) {
+    if (ht->hot) {
+        char replica[HOT_STRING_SIZE];
+        if (hot_lookup(ht->hot, key, replica)) return strdup(replica);
+    }
+
+    // Most misses are answered here without walking (or locking) the chain
+    if (!filter_maybe_contains(atomic_load_explicit(&ht->filter, memory_order_acquire), key)) {
+        atomic_fetch_add_explicit(&ht->filter_negatives, 1, memory_order_relaxed);
+        return NULL;
+    }
+
     int index = hash(key);
+    uint64_t now = 0;
+    bucket_rdlock(ht, index);
     KeyNode *keyNode = ht->table[index];
     char* value;
 
+    // The newest node of a key always comes first in the chain
     while (keyNode != NULL) {
         if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
+            // Expired keys read as missing until the sweeper reclaims them
+            if (!node_is_live(keyNode) || version_expired(keyNode->versions, &now)) break;
+            // Reference bit for the CLOCK hand; only written when it changes
+            if (!atomic_load_explicit(&keyNode->referenced, memory_order_relaxed))
+                atomic_store_explicit(&keyNode->referenced, 1, memory_order_relaxed);
+            if (ht->hot) note_read(ht, keyNode);
+            value = strdup(keyNode->versions->value);
+            pthread_rwlock_unlock(&ht->locks[index]);
             return value; // Return copy of the value if found
         }
         keyNode = keyNode->next; // Move to the next node
     }
+    pthread_rwlock_unlock(&ht->locks[index]);
+    atomic_fetch_add_explicit(&ht->filter_false_positives, 1, memory_order_relaxed);
     return NULL; // Key not found
 }
 
+// A key of a batch read that has to be looked up in its chain.
+typedef struct BatchKey {
+    const char *key;
+    size_t pos;               // Position in the caller's arrays
+    int index;                // Bucket
+    int resolved;             // Its first node in the chain was seen
+} BatchKey;
+
+// Walk of one chain on behalf of the batch keys of its bucket.
+typedef struct ChainCursor {
+    KeyNode *node;            // Next node to look at, already prefetched
+    int index;
+    size_t first, count;      // Keys of the bucket, a sorted run of the batch
+    size_t pending;           // Keys not resolved yet
+} ChainCursor;
+
+static int compare_batch_keys(const void *a, const void *b) {
+    const BatchKey *x = a, *y = b;
+    if (x->index != y->index) return x->index < y->index ? -1 : 1;
+    return strcmp(x->key, y->key);
+}
+
+static int find_batch_key(const void *key, const void *elem) {
+    return strcmp(key, ((const BatchKey *)elem)->key);
+}
+
+// Walks the chains of a window of buckets in turns, one node of each per
+// turn, prefetching the node after next so that the misses of different
+// chains overlap. A single pass over a chain serves every key of its bucket.
+// Must be called with the read locks of the window held.
+static void walk_chains(HashTable *ht, BatchKey *batch, ChainCursor *cursors, size_t num_cursors, char *values[]) {
+    uint64_t now = 0;
+    for (size_t c = 0; c < num_cursors; c++) {
+        cursors[c].node = ht->table[cursors[c].index];
+        if (cursors[c].node) __builtin_prefetch(cursors[c].node);
+    }
+    for (size_t c = 0; c < num_cursors; c++) {
+        KeyNode *node = cursors[c].node;
+        if (node) {
+            __builtin_prefetch(node->key);
+            __builtin_prefetch(node->next);
+        }
+    }
+
+    size_t active = num_cursors;
+    while (active > 0) {
+        active = 0;
+        for (size_t c = 0; c < num_cursors; c++) {
+            ChainCursor *cursor = &cursors[c];
+            KeyNode *node = cursor->node;
+            if (node == NULL || cursor->pending == 0) continue;
+
+            // The newest node of a key always comes first in the chain
+            BatchKey *match = bsearch(node->key, batch + cursor->first, cursor->count, sizeof(BatchKey),
+                                      find_batch_key);
+            if (match != NULL && !match->resolved) {
+                match->resolved = 1;
+                cursor->pending--;
+                if (node_is_live(node) && !version_expired(node->versions, &now)) {
+                    if (!atomic_load_explicit(&node->referenced, memory_order_relaxed))
+                        atomic_store_explicit(&node->referenced, 1, memory_order_relaxed);
+                    if (ht->hot) note_read(ht, node);
+                    values[match->pos] = strdup(node->versions->value);
+                }
+            }
+
+            KeyNode *next = node->next;
+            cursor->node = next;
+            if (next) {
+                __builtin_prefetch(next->key);
+                __builtin_prefetch(next->next);
+                if (cursor->pending > 0) active++;
+            }
+        }
+    }
+}
+
+void read_pairs(HashTable *ht, size_t num_keys, const char *const keys[], char *values[]) {
+    BatchKey *batch = malloc(num_keys * sizeof(BatchKey) + 1);
+    if (batch == NULL) {
+        for (size_t i = 0; i < num_keys; i++) values[i] = read_pair(ht, keys[i]);
+        return;
+    }
+
+    // Replicas and the filter answer what they can before any chain is touched
+    size_t n = 0, misses = 0;
+    for (size_t i = 0; i < num_keys; i++) {
+        values[i] = NULL;
+        if (ht->hot) {
+            char replica[HOT_STRING_SIZE];
+            if (hot_lookup(ht->hot, keys[i], replica)) {
+                values[i] = strdup(replica);
+                continue;
+            }
+        }
+        if (!filter_maybe_contains(atomic_load_explicit(&ht->filter, memory_order_acquire), keys[i])) {
+            atomic_fetch_add_explicit(&ht->filter_negatives, 1, memory_order_relaxed);
+            continue;
+        }
+        int index = hash(keys[i]);
+        if (index < 0) {
+            misses++;
+            continue;
+        }
+        batch[n++] = (BatchKey){keys[i], i, index, 0};
+    }
+    qsort(batch, n, sizeof(BatchKey), compare_batch_keys);
+
+    // Buckets are locked in ascending order, a window at a time
+    ChainCursor cursors[READ_WINDOW];
+    size_t next = 0;
+    while (next < n) {
+        size_t num_cursors = 0;
+        while (next < n && num_cursors < READ_WINDOW) {
+            ChainCursor *cursor = &cursors[num_cursors++];
+            cursor->index = batch[next].index;
+            cursor->first = next;
+            while (next < n && batch[next].index == cursor->index) next++;
+            cursor->count = cursor->pending = next - cursor->first;
+            bucket_rdlock(ht, cursor->index);
+        }
+        walk_chains(ht, batch, cursors, num_cursors, values);
+        for (size_t c = 0; c < num_cursors; c++) {
+            pthread_rwlock_unlock(&ht->locks[cursors[c].index]);
+        }
+    }
+    for (size_t k = 0; k < n; k++) {
+        if (values[batch[k].pos] == NULL) misses++;
+    }
+    if (misses > 0) atomic_fetch_add_explicit(&ht->filter_false_positives, misses, memory_order_relaxed);
+    free(batch);
+}
+
 int delete_pair(HashTable *ht, const char *key) {
+    if (!filter_maybe_contains(atomic_load_explicit(&ht->filter, memory_order_acquire), key)) {
+        atomic_fetch_add_explicit(&ht->filter_negatives, 1, memory_order_relaxed);
+        return 1;
+    }
+
     int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
+    bucket_wrlock(ht, index);
+    uint64_t commit, horizon = begin_commit(ht, &commit);
+    uint64_t now = 0;
+    KeyNode **link = &ht->table[index];
 
     // Search for the key node
-    while (keyNode != NULL) {
+    while (*link != NULL) {
+        KeyNode *keyNode = *link;
         if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
-            }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
-            return 0; // Exit the function
+            if (!node_is_live(keyNode)) break;
+            // An expired key is reclaimed but reported as missing
+            int expired = version_expired(keyNode->versions, &now);
+            if (expired) atomic_fetch_add_explicit(&ht->expirations, 1, memory_order_relaxed);
+            int retired = retire_node(ht, link, commit, horizon) >= 0;
+            pthread_rwlock_unlock(&ht->locks[index]);
+            if (retired && ht->after_commit) ht->after_commit(ht->hook_arg);
+            return !retired || expired; // Exit the function
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
+        link = &keyNode->next; // Move to the next node
     }
     
+    pthread_rwlock_unlock(&ht->locks[index]);
+    atomic_fetch_add_explicit(&ht->filter_false_positives, 1, memory_order_relaxed);
     return 1;
 }
 
+uint64_t pin_snapshot(HashTable *ht) {
+    // Writers stop collecting versions until the snapshot is published
+    atomic_fetch_add(&ht->pinning, 1);
+    pthread_mutex_lock(&ht->snapshot_lock);
+    uint64_t snapshot = atomic_load(&ht->commit_counter);
+    if (ht->num_snapshots == ht->snapshots_capacity) {
+        size_t capacity = ht->snapshots_capacity ? ht->snapshots_capacity * 2 : 8;
+        uint64_t *grown = realloc(ht->snapshots, capacity * sizeof(uint64_t));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&ht->snapshot_lock);
+            atomic_fetch_sub(&ht->pinning, 1);
+            return NO_SNAPSHOT;
+        }
+        ht->snapshots = grown;
+        ht->snapshots_capacity = capacity;
+    }
+    ht->snapshots[ht->num_snapshots++] = snapshot;
+    if (snapshot < atomic_load(&ht->oldest_snapshot)) {
+        atomic_store(&ht->oldest_snapshot, snapshot);
+    }
+    pthread_mutex_unlock(&ht->snapshot_lock);
+    atomic_fetch_sub(&ht->pinning, 1);
+    return snapshot;
+}
+
+void release_snapshot(HashTable *ht, uint64_t snapshot) {
+    if (snapshot == NO_SNAPSHOT) return;
+    pthread_mutex_lock(&ht->snapshot_lock);
+    uint64_t oldest = NO_SNAPSHOT;
+    int removed = 0;
+    for (size_t i = 0; i < ht->num_snapshots; i++) {
+        if (!removed && ht->snapshots[i] == snapshot) {
+            ht->snapshots[i--] = ht->snapshots[--ht->num_snapshots];
+            removed = 1;
+        } else if (ht->snapshots[i] < oldest) {
+            oldest = ht->snapshots[i];
+        }
+    }
+    atomic_store(&ht->oldest_snapshot, oldest);
+    pthread_mutex_unlock(&ht->snapshot_lock);
+    // Writes made while it was pinned may have left the table over its cap
+    if (oldest == NO_SNAPSHOT) evict(ht);
+}
+
+void read_bucket_at(HashTable *ht, int index, uint64_t snapshot, pair_visitor visit, void *arg) {
+    uint64_t now = 0;
+    bucket_rdlock(ht, index);
+    for (KeyNode *node = ht->table[index]; node != NULL; node = node->next) {
+        Version *version = node->versions;
+        while (version != NULL && version->commit > snapshot) {
+            version = version->older;
+        }
+        if (version != NULL && version->value != NULL && !version_expired(version, &now)) {
+            visit(node->key, version->value, arg);
+        }
+    }
+    pthread_rwlock_unlock(&ht->locks[index]);
+}
+
+int enable_value_interning(HashTable *ht) {
+    if (ht->values) return 0;
+    if (atomic_load(&ht->num_keys) != 0) return 1;  // Existing values were not interned
+    ht->values = intern_create();
+    return ht->values == NULL;
+}
+
+int enable_hot_replicas(HashTable *ht) {
+    if (!ht->hot) ht->hot = hot_create();
+    return ht->hot == NULL;
+}
+
+void set_commit_hook(HashTable *ht, commit_hook hook, commit_wait_hook wait, void *arg) {
+    ht->hook_arg = arg;
+    ht->after_commit = wait;
+    ht->on_commit = hook;
+}
+
+void set_memory_limit(HashTable *ht, size_t limit) {
+    atomic_store(&ht->mem_limit, limit);
+    evict(ht);
+}
+
+void table_stats(HashTable *ht, TableStats *stats) {
+    CountingFilter *filter = atomic_load(&ht->filter);
+    stats->num_keys = atomic_load(&ht->num_keys);
+    stats->filter_capacity = filter->capacity;
+    stats->filter_bytes = filter->num_counters * sizeof(filter->counters[0]);
+    stats->filter_negatives = atomic_load(&ht->filter_negatives);
+    stats->filter_false_positives = atomic_load(&ht->filter_false_positives);
+    size_t misses = stats->filter_negatives + stats->filter_false_positives;
+    stats->filter_observed_fpr = misses ? (double)stats->filter_false_positives / (double)misses : 0.0;
+    stats->filter_expected_fpr = filter_expected_fpr(filter, stats->num_keys);
+    stats->mem_used = atomic_load(&ht->mem_used);
+    stats->mem_limit = atomic_load(&ht->mem_limit);
+    stats->evictions = atomic_load(&ht->evictions);
+    stats->expirations = atomic_load(&ht->expirations);
+    stats->lock_wait_ns = atomic_load(&ht->lock_wait_ns);
+    stats->interning = ht->values != NULL;
+    stats->interned_values = stats->interned_bytes = 0;
+    if (ht->values) intern_stats(ht->values, &stats->interned_values, &stats->interned_bytes);
+    stats->hot_replicas = ht->hot != NULL;
+    stats->hot_hits = stats->hot_promotions = 0;
+    if (ht->hot) hot_stats(ht->hot, &stats->hot_hits, &stats->hot_promotions);
+}
+
 void free_table(HashTable *ht) {
+    pthread_mutex_lock(&ht->ttl_lock);
+    int sweeper_running = ht->sweeper_started;
+    ht->sweeper_stopping = 1;
+    pthread_cond_signal(&ht->ttl_cond);
+    pthread_mutex_unlock(&ht->ttl_lock);
+    if (sweeper_running) pthread_join(ht->sweeper, NULL);
+    TimerNode *pending = tw_drain(&ht->ttl_wheel);
+    while (pending != NULL) {
+        ExpiryEntry *entry = TW_CONTAINER_OF(pending, ExpiryEntry, timer);
+        pending = pending->next;
+        free(entry);
+    }
+    pthread_mutex_destroy(&ht->ttl_lock);
+    pthread_cond_destroy(&ht->ttl_cond);
+
     for (int i = 0; i < TABLE_SIZE; i++) {
         KeyNode *keyNode = ht->table[i];
         while (keyNode != NULL) {
             KeyNode *temp = keyNode;
             keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+            free_node(ht, temp);
         }
+        pthread_rwlock_destroy(&ht->locks[i]);
     }
+    intern_free(ht->values);
+    hot_free(ht->hot);
+    filter_free(atomic_load(&ht->filter));
+    pthread_mutex_destroy(&ht->snapshot_lock);
+    pthread_mutex_destroy(&ht->evict_lock);
+    pthread_mutex_destroy(&ht->hot_lock);
+    free(ht->snapshots);
+    free(ht->evict_snapshots);
     free(ht);
 }
\ No newline at end of file
@@ -3,18 +3,113 @@
 
 #define TABLE_SIZE 26
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 
+#include "filter.h"
+#include "hotkeys.h"
+#include "intern.h"
+#include "timer_wheel.h"
+
+#include <stdint.h>
+
+/// One committed value of a key. Versions are kept newest first and trimmed
+/// once no snapshot can still read them.
+typedef struct Version {
+    char *value;              // NULL marks a deletion; shared when values are interned
+    uint64_t commit;          // Value of the commit counter when written
+    uint64_t expires_at;      // Monotonic milliseconds, 0 if it never expires
+    struct Version *older;
+} Version;
+
 typedef struct KeyNode {
     char *key;
-    char *value;
+    Version *versions;        // Newest first
+    atomic_uchar referenced;  // Set by reads, cleared by the eviction hand
+    atomic_uchar hot;         // Replicated in the hot key cache
+    atomic_uint hits;         // Sampled reads, counting towards replication
     struct KeyNode *next;
 } KeyNode;
 
+#define NO_SNAPSHOT UINT64_MAX
+
+/// Called for every write and every removal of a key, in the order they
+/// commit for each key. Removals include evictions and expirations, so a
+/// table fed the same calls ends up with the same keys. Runs with the bucket
+/// lock of the key held.
+/// @param arg Argument given to set_commit_hook.
+/// @param is_delete 1 for a removal, 0 for a write.
+/// @param key Key written or removed.
+/// @param value Value written, NULL for a removal.
+/// @param expires_at When the value expires, in monotonic_ms time, 0 if never.
+typedef void (*commit_hook)(void *arg, int is_delete, const char *key, const char *value, uint64_t expires_at);
+
+/// Called by a writer once it has released the locks it held while its write
+/// or delete went through the commit hook. May block, to slow that writer
+/// down without stalling the ones waiting for its locks.
+/// @param arg Argument given to set_commit_hook.
+typedef void (*commit_wait_hook)(void *arg);
+
 typedef struct HashTable {
     KeyNode *table[TABLE_SIZE];
+    pthread_rwlock_t locks[TABLE_SIZE];       // One per bucket
+    _Atomic(CountingFilter *) filter;         // Keys present in any bucket
+    atomic_size_t num_keys;
+    atomic_int filter_resizing;
+    atomic_size_t filter_negatives;           // Misses answered by the filter alone
+    atomic_size_t filter_false_positives;     // Misses the filter let through
+    atomic_uint_fast64_t commit_counter;      // Stamps every write and delete
+    atomic_uint_fast64_t oldest_snapshot;     // NO_SNAPSHOT when none is pinned
+    atomic_int pinning;                       // Snapshots being pinned right now
+    pthread_mutex_t snapshot_lock;            // Guards the pinned snapshot list
+    uint64_t *snapshots;
+    size_t num_snapshots, snapshots_capacity;
+    atomic_size_t mem_used;                   // Bytes held by nodes, keys and versions
+    atomic_size_t mem_limit;                  // 0 means unlimited
+    atomic_size_t evictions;
+    pthread_mutex_t evict_lock;               // Held by the thread moving the hand
+    uint64_t *evict_snapshots;                // Copy of snapshots, owned by evict_lock
+    size_t evict_snapshots_capacity;
+    int clock_hand;                           // Bucket the eviction hand is on
+    size_t clock_pos;                         // Position of the hand in that bucket
+    pthread_mutex_t ttl_lock;                 // Guards the expiry wheel
+    pthread_cond_t ttl_cond;                  // Wakes the sweeper
+    TimerWheel ttl_wheel;                     // Keys written with a TTL
+    pthread_t sweeper;                        // Started by the first key given a TTL
+    int sweeper_started;
+    int sweeper_stopping;
+    atomic_size_t expirations;
+    InternTable *values;                      // Shared values, NULL unless interning is on
+    HotCache *hot;                            // Replicas of hot keys, NULL unless enabled
+    pthread_mutex_t hot_lock;                 // Serializes promotions and stale flag checks
+    atomic_uint_fast64_t lock_wait_ns;        // Time threads spent blocked on bucket locks
+    commit_hook on_commit;                    // NULL unless mutations are being streamed
+    commit_wait_hook after_commit;            // Backpressure for on_commit, may be NULL
+    void *hook_arg;
 } HashTable;
 
+typedef struct TableStats {
+    size_t num_keys;
+    size_t filter_capacity;
+    size_t filter_bytes;
+    size_t filter_negatives;
+    size_t filter_false_positives;
+    double filter_observed_fpr;   // Share of absent keys the filter let through
+    double filter_expected_fpr;   // Theoretical rate for the current load
+    size_t mem_used;
+    size_t mem_limit;
+    size_t evictions;
+    size_t expirations;
+    uint64_t lock_wait_ns;
+    int interning;
+    size_t interned_values;       // Distinct values held
+    size_t interned_bytes;
+    int hot_replicas;
+    size_t hot_hits;              // Reads served by a replica
+    size_t hot_promotions;        // Keys replicated
+} TableStats;
+
 /// Creates a new event hash table.
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
@@ -26,18 +121,101 @@ struct HashTable *create_hash_table();
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int write_pair(HashTable *ht, const char *key, const char *value);
 
+/// Appends a new key value pair that expires after a given time. Expired
+/// keys are no longer visible and are reclaimed in the background.
+/// @param ht Hash table to be modified.
+/// @param key Key of the pair to be written.
+/// @param value Value of the pair to be written.
+/// @param ttl_ms Time to live in milliseconds, 0 if the pair never expires.
+/// @return 0 if the node was appended successfully, 1 otherwise.
+int write_pair_ttl(HashTable *ht, const char *key, const char *value, unsigned int ttl_ms);
+
+/// Appends a new key value pair that expires at a given time, such as one
+/// replicated from a table in another process on the same host.
+/// @param ht Hash table to be modified.
+/// @param key Key of the pair to be written.
+/// @param value Value of the pair to be written.
+/// @param expires_at When the pair expires, in monotonic_ms time, 0 if never.
+/// @return 0 if the node was appended successfully, 1 otherwise.
+int write_pair_expiring(HashTable *ht, const char *key, const char *value, uint64_t expires_at);
+
 /// Deletes the value of given key.
 /// @param ht Hash table to delete from.
 /// @param key Key of the pair to be deleted.
 /// @return 0 if the node was deleted successfully, 1 otherwise.
 char* read_pair(HashTable *ht, const char *key);
 
+/// Reads several keys at once. Chain walks of different buckets are
+/// interleaved and each chain is walked once for all of its keys.
+/// @param ht Hash table to read.
+/// @param num_keys Number of keys.
+/// @param keys Keys to read, without duplicates.
+/// @param values Where to store a copy of each value, NULL for missing keys.
+void read_pairs(HashTable *ht, size_t num_keys, const char *const keys[], char *values[]);
+
 /// Appends a new node to the list.
 /// @param list Event list to be modified.
 /// @param key Key of the pair to read.
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
+/// Called for every pair visible in a snapshot.
+/// @param key Key of the pair.
+/// @param value Value of the pair.
+/// @param arg Argument given to read_bucket_at.
+typedef void (*pair_visitor)(const char *key, const char *value, void *arg);
+
+/// Pins a snapshot of the table. Writers keep going; versions the snapshot
+/// needs are kept until it is released.
+/// @param ht Hash table to snapshot.
+/// @return Snapshot version, NO_SNAPSHOT on failure.
+uint64_t pin_snapshot(HashTable *ht);
+
+/// Releases a snapshot pinned with pin_snapshot.
+/// @param ht Hash table the snapshot belongs to.
+/// @param snapshot Snapshot version to release.
+void release_snapshot(HashTable *ht, uint64_t snapshot);
+
+/// Visits the pairs of one bucket as they were at a snapshot.
+/// @param ht Hash table to read.
+/// @param index Bucket to read.
+/// @param snapshot Pinned snapshot version.
+/// @param visit Function called for each visible pair.
+/// @param arg Argument passed to visit.
+void read_bucket_at(HashTable *ht, int index, uint64_t snapshot, pair_visitor visit, void *arg);
+
+/// Makes equal values share one refcounted allocation instead of one copy
+/// per pair. Must be enabled before the first pair is written.
+/// @param ht Hash table to configure.
+/// @return 0 if interning is on, 1 otherwise.
+int enable_value_interning(HashTable *ht);
+
+/// Keeps per-CPU replicas of the values of frequently read keys, so reads
+/// of those keys stop sharing the bucket lock. Writes and deletes of a hot
+/// key update its replicas. Must be enabled before other threads use the table.
+/// @param ht Hash table to configure.
+/// @return 0 if replication of hot keys is on, 1 otherwise.
+int enable_hot_replicas(HashTable *ht);
+
+/// Installs the function told about every committed write and delete. Must
+/// be set before other threads use the table.
+/// @param ht Hash table to observe.
+/// @param hook Function to call, NULL to stop.
+/// @param wait Function each writer calls after unlocking, NULL if none.
+/// @param arg Argument passed to hook and wait.
+void set_commit_hook(HashTable *ht, commit_hook hook, commit_wait_hook wait, void *arg);
+
+/// Sets the memory budget. Once it is exceeded, writes evict keys that were
+/// not read recently until usage is back under the cap.
+/// @param ht Hash table to configure.
+/// @param limit Maximum number of bytes for keys and values, 0 for no limit.
+void set_memory_limit(HashTable *ht, size_t limit);
+
+/// Collects statistics about the table and its membership filter.
+/// @param ht Hash table to inspect.
+/// @param stats Where to store the statistics.
+void table_stats(HashTable *ht, TableStats *stats);
+
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
@@ -4,8 +4,12 @@
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include "bckz.h"
 #include "kvs.h"
 #include "constants.h"
+#include "operations.h"
+#include "replication.h"
+#include "throttle.h"
 
 static struct HashTable *kvs_table = NULL;
 
@@ -24,6 +28,89 @@ static int compare_keys(const void *a, const void *b)
     return strcmp(key_a, key_b);
 }
 
+// Pares de um bucket acumulados para serem escritos fora do lock
+typedef struct
+{
+    char *data;
+    size_t len, cap;
+} PairBuffer;
+
+static void buffer_reserve(PairBuffer *buf, size_t extra)
+{
+    if (buf->len + extra <= buf->cap)
+        return;
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + extra)
+        cap *= 2;
+    char *data = realloc(buf->data, cap);
+    if (data == NULL)
+        return;
+    buf->data = data;
+    buf->cap = cap;
+}
+
+static void show_visitor(const char *key, const char *value, void *arg)
+{
+    PairBuffer *buf = arg;
+    size_t extra = strlen(key) + strlen(value) + sizeof("(, )\n");
+    buffer_reserve(buf, extra);
+    if (buf->len + extra <= buf->cap)
+        buf->len += (size_t)snprintf(buf->data + buf->len, extra, "(%s, %s)\n", key, value);
+}
+
+static void backup_visitor(const char *key, const char *value, void *arg)
+{
+    PairBuffer *buf = arg;
+    size_t extra = strlen(key) + strlen(value) + sizeof("=\n");
+    buffer_reserve(buf, extra);
+    if (buf->len + extra <= buf->cap)
+        buf->len += (size_t)snprintf(buf->data + buf->len, extra, "%s=%s\n", key, value);
+}
+
+static void write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+        if (written <= 0)
+        {
+            perror("Error writing output");
+            return;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+}
+
+// Escreve a tabela tal como estava num snapshot: comprimida, se z não for
+// NULL, ou diretamente com output (write_all se for NULL). Os writers
+// continuam a correr: só esperam pelo bucket que está a ser copiado para o
+// buffer, e nunca pela escrita.
+static int dump_snapshot_at(int fd, BckzWriter *z, bckz_output output, uint64_t snapshot, pair_visitor visit)
+{
+    PairBuffer buf = {NULL, 0, 0};
+    int failed = 0;
+    for (int i = 0; i < TABLE_SIZE; i++)
+    {
+        buf.len = 0;
+        read_bucket_at(kvs_table, i, snapshot, visit, &buf);
+        if (z != NULL)
+            failed |= bckz_write(z, buf.data, buf.len);
+        else if (output != NULL)
+            failed |= output(fd, buf.data, buf.len);
+        else
+            write_all(fd, buf.data, buf.len);
+    }
+    release_snapshot(kvs_table, snapshot);
+    free(buf.data);
+    return failed;
+}
+
+static void dump_snapshot(int fd, pair_visitor visit)
+{
+    dump_snapshot_at(fd, NULL, NULL, pin_snapshot(kvs_table), visit);
+}
+
 int kvs_init()
 {
     if (kvs_table != NULL)
@@ -44,11 +131,24 @@ int kvs_terminate()
         return 1;
     }
 
+    // O primário envia o resto do log; o seguidor aplica-o até ao fim
+    repl_stop();
     free_table(kvs_table);
     return 0;
 }
 
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE])
+{
+    const char *key_ptrs[num_pairs + 1], *value_ptrs[num_pairs + 1];
+    for (size_t i = 0; i < num_pairs; i++)
+    {
+        key_ptrs[i] = keys[i];
+        value_ptrs[i] = values[i];
+    }
+    return kvs_write_pairs(num_pairs, key_ptrs, value_ptrs, 0);
+}
+
+int kvs_write_pairs(size_t num_pairs, const char *const keys[], const char *const values[], unsigned int ttl_ms)
 {
     if (kvs_table == NULL)
     {
@@ -58,7 +158,7 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_
 
     for (size_t i = 0; i < num_pairs; i++)
     {
-        if (write_pair(kvs_table, keys[i], values[i]) != 0)
+        if (write_pair_ttl(kvs_table, keys[i], values[i], ttl_ms) != 0)
         {
             fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
         }
@@ -68,6 +168,16 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_
 }
 
 int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd)
+{
+    const char *key_ptrs[num_pairs + 1];
+    for (size_t i = 0; i < num_pairs; i++)
+    {
+        key_ptrs[i] = keys[i];
+    }
+    return kvs_read_keys(num_pairs, key_ptrs, out_fd);
+}
+
+int kvs_read_keys(size_t num_pairs, const char *const keys[], int out_fd)
 {
     if (kvs_table == NULL)
     {
@@ -76,7 +186,7 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd)
     }
 
     // Copiar as chaves para um array de ponteiros para facilitar a ordenação
-    char *sorted_keys[num_pairs];
+    const char *sorted_keys[num_pairs + 1];
     for (size_t i = 0; i < num_pairs; i++)
     {
         sorted_keys[i] = keys[i];
@@ -85,12 +195,24 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd)
     // Ordenar as chaves
     qsort(sorted_keys, num_pairs, sizeof(char *), compare_keys);
 
+    // Cada chave repetida só é lida uma vez, mas continua a aparecer na saída
+    const char *unique_keys[num_pairs + 1];
+    char *values[num_pairs + 1];
+    size_t num_unique = 0;
+    for (size_t i = 0; i < num_pairs; i++)
+    {
+        if (num_unique == 0 || strcmp(unique_keys[num_unique - 1], sorted_keys[i]) != 0)
+            unique_keys[num_unique++] = sorted_keys[i];
+    }
+    read_pairs(kvs_table, num_unique, unique_keys, values);
+
     int has_errors = 0; // Indica se há erros para abrir os parênteses retos
 
-    for (size_t i = 0; i < num_pairs; i++)
+    for (size_t i = 0, u = 0; i < num_pairs; i++)
     {
-        char *value = read_pair(kvs_table, sorted_keys[i]);
-        if (value == NULL)
+        if (strcmp(unique_keys[u], sorted_keys[i]) != 0)
+            u++;
+        if (values[u] == NULL)
         {
             if (!has_errors)
             {
@@ -100,15 +222,10 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd)
             }
             dprintf(out_fd, "(%s,KVSERROR)", sorted_keys[i]);
         }
-        else
-        {
-            free(value); // Liberar memória de chaves válidas
-        }
-
-        if (value == NULL && i < num_pairs - 1)
-        {
-            // Adiciona espaços apenas para erros antes do último item
-        }
+    }
+    for (size_t u = 0; u < num_unique; u++)
+    {
+        free(values[u]); // Liberar memória de chaves válidas
     }
 
     if (has_errors)
@@ -121,6 +238,16 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd)
 }
 
 int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd)
+{
+    const char *key_ptrs[num_pairs + 1];
+    for (size_t i = 0; i < num_pairs; i++)
+    {
+        key_ptrs[i] = keys[i];
+    }
+    return kvs_delete_keys(num_pairs, key_ptrs, out_fd);
+}
+
+int kvs_delete_keys(size_t num_pairs, const char *const keys[], int out_fd)
 {
     if (kvs_table == NULL)
     {
@@ -164,15 +291,56 @@ void kvs_show(int fd)
         return;
     }
 
-    for (int i = 0; i < TABLE_SIZE; i++)
+    dump_snapshot(fd, show_visitor);
+}
+
+uint64_t kvs_snapshot()
+{
+    if (kvs_table == NULL)
+        return NO_SNAPSHOT;
+
+    return pin_snapshot(kvs_table);
+}
+
+void kvs_release_snapshot(uint64_t snapshot)
+{
+    if (kvs_table != NULL)
+        release_snapshot(kvs_table, snapshot);
+}
+
+void kvs_show_snapshot(int fd, uint64_t snapshot)
+{
+    if (kvs_table == NULL)
     {
-        KeyNode *node = kvs_table->table[i];
-        while (node)
-        {
-            dprintf(fd, "(%s, %s)\n", node->key, node->value);
-            node = node->next;
-        }
+        dprintf(fd, "KVS not initialized\n");
+        return;
+    }
+
+    dump_snapshot_at(fd, NULL, NULL, snapshot, show_visitor);
+}
+
+int kvs_backup_snapshot(int fd, uint64_t snapshot, unsigned int compress_threads)
+{
+    if (kvs_table == NULL)
+    {
+        fprintf(stderr, "KVS state must be initialized\n");
+        return 1;
+    }
+
+    throttle_begin();
+    BckzWriter *z = NULL;
+    if (compress_threads > 0 && (z = bckz_open(fd, compress_threads, throttle_write)) == NULL)
+    {
+        release_snapshot(kvs_table, snapshot);
+        throttle_end(fd);
+        fprintf(stderr, "Failed to start compressed backup\n");
+        return 1;
     }
+    int failed = dump_snapshot_at(fd, z, throttle_write, snapshot, show_visitor);
+    if (z != NULL)
+        failed |= bckz_close(z);
+    throttle_end(fd);
+    return failed;
 }
 
 int kvs_backup(const char *backup_file)
@@ -204,21 +372,128 @@ int kvs_backup(const char *backup_file)
         printf("Backup file does not exist: %s\n", backup_file);
     }
 
-    for (int i = 0; i < TABLE_SIZE; i++)
-    {
-        KeyNode *node = kvs_table->table[i];
-        while (node)
-        {
-            dprintf(fd, "%s=%s\n", node->key, node->value);
-            node = node->next;
-        }
-    }
+    dump_snapshot(fd, backup_visitor);
 
     close(fd);
     printf("Backup completed successfully\n");
     return 0;
 }
 
+int kvs_set_memory_limit(size_t limit)
+{
+    if (kvs_table == NULL)
+    {
+        fprintf(stderr, "KVS state must be initialized\n");
+        return 1;
+    }
+
+    set_memory_limit(kvs_table, limit);
+    return 0;
+}
+
+int kvs_enable_interning()
+{
+    if (kvs_table == NULL)
+    {
+        fprintf(stderr, "KVS state must be initialized\n");
+        return 1;
+    }
+
+    return enable_value_interning(kvs_table);
+}
+
+int kvs_enable_hot_replicas()
+{
+    if (kvs_table == NULL)
+    {
+        fprintf(stderr, "KVS state must be initialized\n");
+        return 1;
+    }
+
+    return enable_hot_replicas(kvs_table);
+}
+
+int kvs_replicate(const char *socket_path)
+{
+    if (kvs_table == NULL)
+    {
+        fprintf(stderr, "KVS state must be initialized\n");
+        return 1;
+    }
+
+    return repl_primary_start(kvs_table, socket_path);
+}
+
+int kvs_follow(const char *socket_path)
+{
+    if (kvs_table == NULL)
+    {
+        fprintf(stderr, "KVS state must be initialized\n");
+        return 1;
+    }
+
+    return repl_follower_start(kvs_table, socket_path);
+}
+
+uint64_t kvs_lock_wait_ns()
+{
+    if (kvs_table == NULL)
+        return 0;
+
+    return atomic_load_explicit(&kvs_table->lock_wait_ns, memory_order_relaxed);
+}
+
+void kvs_stats(int fd)
+{
+    if (kvs_table == NULL)
+    {
+        dprintf(fd, "KVS not initialized\n");
+        return;
+    }
+
+    TableStats stats;
+    table_stats(kvs_table, &stats);
+    dprintf(fd, "keys: %zu\n", stats.num_keys);
+    dprintf(fd, "filter: capacity %zu keys, %zu bytes\n", stats.filter_capacity, stats.filter_bytes);
+    dprintf(fd, "filter: %zu misses short-circuited, %zu false positives\n",
+            stats.filter_negatives, stats.filter_false_positives);
+    dprintf(fd, "filter: false positive rate %.4f observed, %.4f expected\n",
+            stats.filter_observed_fpr, stats.filter_expected_fpr);
+    if (stats.mem_limit)
+        dprintf(fd, "memory: %zu of %zu bytes used, %zu evictions\n", stats.mem_used, stats.mem_limit, stats.evictions);
+    else
+        dprintf(fd, "memory: %zu bytes used, no limit\n", stats.mem_used);
+    dprintf(fd, "ttl: %zu keys expired\n", stats.expirations);
+    dprintf(fd, "locks: %.3f ms blocked on buckets\n", (double)stats.lock_wait_ns / 1e6);
+    if (stats.interning)
+        dprintf(fd, "values: %zu distinct interned, %zu bytes\n", stats.interned_values, stats.interned_bytes);
+    if (stats.hot_replicas)
+        dprintf(fd, "hot keys: %zu replicated, %zu reads served by replicas\n", stats.hot_promotions, stats.hot_hits);
+
+    ThrottleStats io;
+    throttle_stats(&io);
+    if (io.backups > 0)
+        dprintf(fd, "backups: %llu written, %llu bytes in %llu writes, %.2f MB/s, %.3f ms throttled\n",
+                (unsigned long long)io.backups, (unsigned long long)io.bytes, (unsigned long long)io.writes,
+                io.busy_ns ? (double)io.bytes / ((double)io.busy_ns / 1e9) / 1e6 : 0.0, (double)io.throttled_ns / 1e6);
+    uint64_t raw, stored;
+    bckz_stats(&raw, &stored);
+    if (raw > 0)
+        dprintf(fd, "compression: %llu backup bytes stored in %llu (%.1f%%)\n", (unsigned long long)raw,
+                (unsigned long long)stored, 100.0 * (double)stored / (double)raw);
+
+    ReplStats repl;
+    repl_stats(&repl);
+    if (repl.role == REPL_PRIMARY)
+        dprintf(fd, "replication: primary, %llu records logged, %llu bytes sent, %llu bytes pending%s\n",
+                (unsigned long long)repl.records, (unsigned long long)repl.bytes,
+                (unsigned long long)repl.pending_bytes, repl.broken ? ", stream broken" : "");
+    else if (repl.role == REPL_FOLLOWER)
+        dprintf(fd, "replication: follower, %llu records applied, lag %.3f ms (max %.3f ms)%s\n",
+                (unsigned long long)repl.records, (double)repl.last_lag_ns / 1e6,
+                (double)repl.max_lag_ns / 1e6, repl.broken ? ", stream broken" : "");
+}
+
 void kvs_wait(unsigned int delay_ms)
 {
     struct timespec delay = delay_to_timespec(delay_ms);
@@ -1,6 +1,7 @@
 #ifndef KVS_OPERATIONS_H
 #define KVS_OPERATIONS_H
 #include <stddef.h>
+#include <stdint.h>
 
 
 
@@ -19,6 +20,14 @@ int kvs_terminate();
 /// @return 0 if the pairs were written successfully, 1 otherwise.
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
 
+/// Writes key value pairs, optionally expiring after a given time.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of pointers to the keys.
+/// @param values Array of pointers to the values.
+/// @param ttl_ms Time to live in milliseconds, 0 if the pairs never expire.
+/// @return 0 if the pairs were written successfully, 1 otherwise.
+int kvs_write_pairs(size_t num_pairs, const char *const keys[], const char *const values[], unsigned int ttl_ms);
+
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
@@ -26,16 +35,50 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_
 /// @return 0 if the key reading, 1 otherwise.
 int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd);
 
+/// Reads values from the KVS, given pointers to the keys.
+/// @param num_pairs Number of pairs to read.
+/// @param keys Array of pointers to the keys.
+/// @param fd File descriptor to write the (successful) output.
+/// @return 0 if the key reading, 1 otherwise.
+int kvs_read_keys(size_t num_pairs, const char *const keys[], int out_fd);
+
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
 int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd);
 
+/// Deletes key value pairs from the KVS, given pointers to the keys.
+/// @param num_pairs Number of pairs to read.
+/// @param keys Array of pointers to the keys.
+/// @return 0 if the pairs were deleted successfully, 1 otherwise.
+int kvs_delete_keys(size_t num_pairs, const char *const keys[], int out_fd);
+
 /// Writes the state of the KVS.
 /// @param fd File descriptor to write the output.
 void kvs_show(int fd);
 
+/// Fixes the state that a later kvs_show_snapshot or kvs_backup_snapshot writes.
+/// @return Pinned snapshot, to be passed to kvs_show_snapshot or kvs_backup_snapshot.
+uint64_t kvs_snapshot();
+
+/// Releases a snapshot that will not be written.
+/// @param snapshot Snapshot returned by kvs_snapshot.
+void kvs_release_snapshot(uint64_t snapshot);
+
+/// Writes the state of the KVS as it was at a snapshot, then releases it.
+/// @param fd File descriptor to write the output.
+/// @param snapshot Snapshot returned by kvs_snapshot.
+void kvs_show_snapshot(int fd, uint64_t snapshot);
+
+/// Writes a backup of the KVS as it was at a snapshot, then releases it.
+/// The writes stay within the backup I/O budget set with throttle_configure.
+/// @param fd File descriptor to write the backup, at the start of the file.
+/// @param snapshot Snapshot returned by kvs_snapshot.
+/// @param compress_threads Blocks compressed in parallel, 0 for a text dump.
+/// @return 0 if the backup was written, 1 otherwise.
+int kvs_backup_snapshot(int fd, uint64_t snapshot, unsigned int compress_threads);
+
 /// Creates a backup of the KVS state and stores it in the correspondent
 /// backup file
 /// @return 0 if the backup was successful, 1 otherwise.
@@ -44,6 +87,42 @@ int kvs_backup(const char *backup_file);
 /// Waits for the last backup to be called.
 void kvs_wait_backup();
 
+/// Caps the memory used by keys and values. Cold keys are evicted once the
+/// cap is reached.
+/// @param limit Maximum number of bytes, 0 for no limit.
+/// @return 0 if the limit was set, 1 otherwise.
+int kvs_set_memory_limit(size_t limit);
+
+/// Stores each distinct value once, shared by every pair that holds it.
+/// Must be called before any pair is written.
+/// @return 0 if interning was enabled, 1 otherwise.
+int kvs_enable_interning();
+
+/// Serves reads of the most read keys from per-CPU copies of their values.
+/// Must be called before any job runs.
+/// @return 0 if hot key replicas were enabled, 1 otherwise.
+int kvs_enable_hot_replicas();
+
+/// Streams every write and delete to a follower listening on a UNIX socket.
+/// @param socket_path Path of the follower's socket.
+/// @return 0 if streaming started, 1 otherwise.
+int kvs_replicate(const char *socket_path);
+
+/// Applies the stream of a primary that connects to a UNIX socket. The
+/// stream keeps being applied until the primary closes it, even after the
+/// follower's own jobs are done.
+/// @param socket_path Path of the socket to create.
+/// @return 0 if the follower is listening, 1 otherwise.
+int kvs_follow(const char *socket_path);
+
+/// Total time threads have spent blocked on table locks.
+/// @return Nanoseconds spent waiting.
+uint64_t kvs_lock_wait_ns();
+
+/// Writes statistics about the KVS.
+/// @param fd File descriptor to write the statistics.
+void kvs_stats(int fd);
+
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
 void kvs_wait(unsigned int delay_ms);
@@ -182,7 +182,7 @@ int parse_pair(int fd, char *key, char *value) {
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+size_t parse_write_ttl(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size, unsigned int *ttl_ms) {
   char ch;
 
   if (read(fd, &ch, 1) != 1 || ch != '[') {
@@ -222,7 +222,30 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (read(fd, &ch, 1) != 1) {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (ttl_ms != NULL) {
+    *ttl_ms = 0;
+  }
+
+  if (ch == ' ') {
+    // Optional expiry: WRITE [(key,value)...] TTL <ttl_ms>
+    char buf[4];
+    if (ttl_ms == NULL || read(fd, buf, 4) != 4 || strncmp(buf, "TTL ", 4) != 0) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (read_uint(fd, ttl_ms, &ch) != 0 || *ttl_ms == 0) {
+      cleanup(fd);
+      return 0;
+    }
+  }
+
+  if (ch != '\n' && ch != '\0') {
     cleanup(fd);
     return 0;
   }
@@ -230,6 +253,10 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
   return num_pairs;
 }
 
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+  return parse_write_ttl(fd, keys, values, max_pairs, max_string_size, NULL);
+}
+
 size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
   char ch;
 
@@ -31,6 +31,16 @@ enum Command get_next(int fd);
 /// @return 0 if the command was parsed successfully, 1 otherwise.
 size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
 
+/// Parses a WRITE command that may end with an expiry: WRITE [...] TTL <ttl_ms>.
+/// @param fd File descriptor to read from.
+/// @param keys Array of keys to be written.
+/// @param values Array of values to be written.
+/// @param max_pairs number of pairs to be written.
+/// @param max_string_size maximum size for keys and values.
+/// @param ttl_ms Pointer to the variable to store the time to live in, 0 if none was given.
+/// @return Number of pairs parsed. 0 on failure.
+size_t parse_write_ttl(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size, unsigned int *ttl_ms);
+
 /// Parses a READ or DELETE command.
 /// @param fd File descriptor to read from.
 /// @param keys Array of keys to be written.
@@ -0,0 +1,140 @@
+#include "pipeline.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jobc.h"
+#include "trace.h"
+
+#define RING_SLOTS 16  // Power of two; a few records ahead are enough to hide parsing
+
+struct JobPipeline {
+    JobcBuffer slots[RING_SLOTS];
+    atomic_size_t head;        // Next slot to consume, written by the executor
+    atomic_size_t tail;        // Next slot to fill, written by the parser
+    int holding;               // The executor is still using the slot at head
+    atomic_int sleepers;       // Threads blocked on cond, checked before signalling
+    atomic_int stopping;
+    pthread_mutex_t lock;      // Only used to sleep when the ring is full or empty
+    pthread_cond_t cond;
+    pthread_t parser;
+    int fd;
+};
+
+// Wakes the other stage if it went to sleep. The sleeper publishes itself
+// before checking the ring again, so either it sees our update or we see it.
+static void wake(JobPipeline *pipeline) {
+    if (atomic_load(&pipeline->sleepers) > 0) {
+        pthread_mutex_lock(&pipeline->lock);
+        pthread_cond_broadcast(&pipeline->cond);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+}
+
+// Sleeps until ready(pipeline) holds.
+static void wait_until(JobPipeline *pipeline, int (*ready)(JobPipeline *)) {
+    if (ready(pipeline)) return;
+    pthread_mutex_lock(&pipeline->lock);
+    atomic_fetch_add(&pipeline->sleepers, 1);
+    while (!ready(pipeline)) {
+        pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    }
+    atomic_fetch_sub(&pipeline->sleepers, 1);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static int has_room(JobPipeline *pipeline) {
+    return atomic_load(&pipeline->tail) - atomic_load(&pipeline->head) < RING_SLOTS ||
+           atomic_load(&pipeline->stopping);
+}
+
+static int has_record(JobPipeline *pipeline) {
+    return atomic_load(&pipeline->tail) != atomic_load(&pipeline->head);
+}
+
+static void *parser_func(void *arg) {
+    JobPipeline *pipeline = arg;
+    enum Command cmd;
+    trace_thread_name("parser");
+    do {
+        wait_until(pipeline, has_room);
+        if (atomic_load(&pipeline->stopping)) break;
+
+        size_t tail = atomic_load_explicit(&pipeline->tail, memory_order_relaxed);
+        JobcBuffer *slot = &pipeline->slots[tail % RING_SLOTS];
+        slot->len = 0;
+        cmd = jobc_encode_next(pipeline->fd, slot);
+        if (slot->len == 0) {
+            // Out of memory: end the job here rather than lose commands silently
+            fprintf(stderr, "Failed to parse job command\n");
+            slot->data[0] = EOC;
+            slot->len = 1;
+            cmd = EOC;
+        }
+        atomic_store(&pipeline->tail, tail + 1);
+        wake(pipeline);
+    } while (cmd != EOC);
+    return NULL;
+}
+
+JobPipeline *pipeline_start(int fd) {
+    JobPipeline *pipeline = calloc(1, sizeof(JobPipeline));
+    if (!pipeline) return NULL;
+    // Slot buffers are allocated up front so that an EOC can always be stored
+    for (size_t i = 0; i < RING_SLOTS; i++) {
+        pipeline->slots[i].data = malloc(1);
+        if (!pipeline->slots[i].data) {
+            for (size_t j = 0; j < i; j++) jobc_buffer_free(&pipeline->slots[j]);
+            free(pipeline);
+            return NULL;
+        }
+        pipeline->slots[i].cap = 1;
+    }
+    atomic_init(&pipeline->head, 0);
+    atomic_init(&pipeline->tail, 0);
+    atomic_init(&pipeline->sleepers, 0);
+    atomic_init(&pipeline->stopping, 0);
+    pipeline->holding = 0;
+    pipeline->fd = fd;
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->cond, NULL);
+    if (pthread_create(&pipeline->parser, NULL, parser_func, pipeline) != 0) {
+        perror("Failed to create parser thread");
+        pthread_mutex_destroy(&pipeline->lock);
+        pthread_cond_destroy(&pipeline->cond);
+        for (size_t i = 0; i < RING_SLOTS; i++) jobc_buffer_free(&pipeline->slots[i]);
+        free(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+const uint8_t *pipeline_next(JobPipeline *pipeline, const uint8_t **end) {
+    // The previous record has been executed: hand its slot back to the parser
+    if (pipeline->holding) {
+        atomic_fetch_add(&pipeline->head, 1);
+        wake(pipeline);
+    }
+    wait_until(pipeline, has_record);
+    pipeline->holding = 1;
+
+    size_t head = atomic_load_explicit(&pipeline->head, memory_order_acquire);
+    JobcBuffer *slot = &pipeline->slots[head % RING_SLOTS];
+    *end = slot->data + slot->len;
+    return slot->data;
+}
+
+void pipeline_stop(JobPipeline *pipeline) {
+    atomic_store(&pipeline->stopping, 1);
+    pthread_mutex_lock(&pipeline->lock);
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+    pthread_join(pipeline->parser, NULL);
+
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->cond);
+    for (size_t i = 0; i < RING_SLOTS; i++) jobc_buffer_free(&pipeline->slots[i]);
+    free(pipeline);
+}
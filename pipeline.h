@@ -0,0 +1,30 @@
+#ifndef KVS_PIPELINE_H
+#define KVS_PIPELINE_H
+
+#include <stdint.h>
+
+/// Parse stage of a job. A dedicated thread reads the .job text and encodes
+/// each command as a jobc record into a bounded single-producer,
+/// single-consumer ring, so tokenizing overlaps with executing the commands
+/// already parsed. Records are consumed in the order they were parsed.
+typedef struct JobPipeline JobPipeline;
+
+/// Starts the parse stage.
+/// @param fd File descriptor of the .job file. Owned by the caller and must
+///           stay open until pipeline_stop.
+/// @return Newly started pipeline, NULL on failure.
+JobPipeline *pipeline_start(int fd);
+
+/// Waits for the next record. It stays valid until pipeline_next is called
+/// again. The last record of a job is EOC.
+/// @param pipeline Pipeline to read from.
+/// @param end Where to store the end of the record.
+/// @return Start of the record.
+const uint8_t *pipeline_next(JobPipeline *pipeline, const uint8_t **end);
+
+/// Stops the parse stage, even if the job was not read to the end, and
+/// frees the pipeline.
+/// @param pipeline Pipeline to stop.
+void pipeline_stop(JobPipeline *pipeline);
+
+#endif  // KVS_PIPELINE_H
@@ -0,0 +1,327 @@
+#include "replication.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Record: op, key length, value length, expiry and commit time, followed by
+// the key and the value, each with its NUL so the follower applies them in
+// place. Both times are on the monotonic clock, which primary and follower
+// share since they talk over a UNIX socket on the same host: the follower
+// expires a key when the primary does, however late the record arrives.
+#define REPL_HEADER_SIZE 21
+#define REPL_MAX_PENDING (8u << 20)    // Writers wait once this much is unsent
+#define REPL_RECV_SIZE (256u << 10)    // Larger than any record
+#define REPL_CONNECT_ATTEMPTS 50
+#define REPL_CONNECT_DELAY_MS 100
+
+enum { OP_WRITE = 1, OP_DELETE = 2 };
+
+typedef struct LogBuffer {
+    uint8_t *data;
+    size_t len, cap;
+} LogBuffer;
+
+static int role = REPL_NONE;
+static HashTable *table = NULL;
+static int sock = -1, listen_sock = -1;
+static struct sockaddr_un address;
+static pthread_t thread;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_ready = PTHREAD_COND_INITIALIZER;  // The sender has work
+static pthread_cond_t log_room = PTHREAD_COND_INITIALIZER;   // Writers may append again
+static LogBuffer log_buf = {NULL, 0, 0}, send_buf = {NULL, 0, 0};
+static size_t in_flight = 0;
+static int stopping = 0, connected = 0;
+static atomic_int broken = 0;
+
+static atomic_uint_fast64_t records = 0, bytes = 0;
+static atomic_uint_fast64_t last_lag_ns = 0, max_lag_ns = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int set_address(const char *socket_path) {
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    return 0;
+}
+
+static int log_reserve(LogBuffer *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return 0;
+    size_t cap = buf->cap ? buf->cap : 65536;
+    while (cap < buf->len + extra) cap *= 2;
+    uint8_t *data = realloc(buf->data, cap);
+    if (!data) return 1;
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+// Commit hook of the primary. Runs under the key's bucket lock, so records
+// of the same key are logged in the order they were applied. It never waits:
+// a full log is only waited on in log_wait, once the locks are released, so
+// the log may exceed REPL_MAX_PENDING by one record per writer.
+static void log_commit(void *arg, int is_delete, const char *key, const char *value, uint64_t expires_at) {
+    (void)arg;
+    uint64_t committed = now_ns();
+    size_t key_len = strlen(key), value_len = value ? strlen(value) : 0;
+    if (key_len > UINT16_MAX || value_len > UINT16_MAX) {
+        fprintf(stderr, "Pair too long to replicate, stopping replication\n");
+        atomic_store(&broken, 1);
+        return;
+    }
+    size_t size = REPL_HEADER_SIZE + key_len + 1 + (is_delete ? 0 : value_len + 1);
+
+    pthread_mutex_lock(&log_lock);
+    if (atomic_load(&broken) || log_reserve(&log_buf, size) != 0) {
+        pthread_mutex_unlock(&log_lock);
+        return;
+    }
+    uint8_t *p = log_buf.data + log_buf.len;
+    uint16_t lengths[2] = {(uint16_t)key_len, (uint16_t)value_len};
+    p[0] = is_delete ? OP_DELETE : OP_WRITE;
+    memcpy(p + 1, lengths, 4);
+    memcpy(p + 5, &expires_at, 8);
+    memcpy(p + 13, &committed, 8);
+    p += REPL_HEADER_SIZE;
+    memcpy(p, key, key_len + 1);
+    if (!is_delete) memcpy(p + key_len + 1, value, value_len + 1);
+    if (log_buf.len == 0) pthread_cond_signal(&log_ready);
+    log_buf.len += size;
+    atomic_fetch_add_explicit(&records, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&log_lock);
+}
+
+// Backpressure hook of the primary: writers wait here, holding no bucket
+// lock, while the sender is too far behind.
+static void log_wait(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&log_lock);
+    while (!atomic_load(&broken) && log_buf.len > 0 && log_buf.len + in_flight > REPL_MAX_PENDING) {
+        pthread_cond_wait(&log_room, &log_lock);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+static int send_all(const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(sock, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return 1;
+        data += sent;
+        len -= (size_t)sent;
+    }
+    return 0;
+}
+
+// Ships the log. Writers keep appending to one buffer while the other is on
+// the wire, so every send carries whatever accumulated during the last one.
+static void *sender_func(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&log_lock);
+    for (;;) {
+        while (log_buf.len == 0 && !stopping) {
+            pthread_cond_wait(&log_ready, &log_lock);
+        }
+        if (log_buf.len == 0) break;
+
+        LogBuffer full = log_buf;
+        log_buf = send_buf;
+        log_buf.len = 0;
+        in_flight = full.len;
+        pthread_cond_broadcast(&log_room);
+        pthread_mutex_unlock(&log_lock);
+
+        int failed = send_all(full.data, full.len);
+        if (!failed) atomic_fetch_add_explicit(&bytes, full.len, memory_order_relaxed);
+
+        pthread_mutex_lock(&log_lock);
+        send_buf = full;
+        in_flight = 0;
+        if (failed) {
+            perror("Replication stream failed");
+            atomic_store(&broken, 1);
+            pthread_cond_broadcast(&log_room);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+int repl_primary_start(HashTable *ht, const char *socket_path) {
+    if (role != REPL_NONE || set_address(socket_path) != 0) return 1;
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        perror("Failed to create replication socket");
+        return 1;
+    }
+    // The follower may still be starting up
+    int attempt = 0;
+    while (connect(sock, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        if (++attempt == REPL_CONNECT_ATTEMPTS || (errno != ENOENT && errno != ECONNREFUSED)) {
+            perror("Failed to connect to the follower");
+            close(sock);
+            sock = -1;
+            return 1;
+        }
+        struct timespec delay = {0, REPL_CONNECT_DELAY_MS * 1000000L};
+        nanosleep(&delay, NULL);
+    }
+    if (pthread_create(&thread, NULL, sender_func, NULL) != 0) {
+        perror("Failed to start replication");
+        close(sock);
+        sock = -1;
+        return 1;
+    }
+    role = REPL_PRIMARY;
+    table = ht;
+    connected = 1;
+    set_commit_hook(ht, log_commit, log_wait, NULL);
+    return 0;
+}
+
+// Applies every complete record in data and returns how many bytes it used.
+static size_t apply_records(const uint8_t *data, size_t len) {
+    size_t used = 0;
+    while (len - used >= REPL_HEADER_SIZE) {
+        const uint8_t *p = data + used;
+        uint16_t lengths[2];
+        uint64_t expires_at, committed;
+        memcpy(lengths, p + 1, 4);
+        memcpy(&expires_at, p + 5, 8);
+        memcpy(&committed, p + 13, 8);
+        size_t size = REPL_HEADER_SIZE + lengths[0] + 1u + (p[0] == OP_DELETE ? 0u : lengths[1] + 1u);
+        if (len - used < size) break;
+
+        const char *key = (const char *)p + REPL_HEADER_SIZE;
+        if (p[0] == OP_DELETE) {
+            delete_pair(table, key);
+        } else if (write_pair_expiring(table, key, key + lengths[0] + 1, expires_at) != 0) {
+            fprintf(stderr, "Failed to apply replicated write of %s\n", key);
+        }
+        uint64_t lag = now_ns() - committed;
+        atomic_store_explicit(&last_lag_ns, lag, memory_order_relaxed);
+        if (lag > atomic_load_explicit(&max_lag_ns, memory_order_relaxed))
+            atomic_store_explicit(&max_lag_ns, lag, memory_order_relaxed);
+        atomic_fetch_add_explicit(&records, 1, memory_order_relaxed);
+        used += size;
+    }
+    return used;
+}
+
+static void *receiver_func(void *arg) {
+    (void)arg;
+    int fd = accept(listen_sock, NULL, NULL);
+    pthread_mutex_lock(&log_lock);
+    sock = fd;
+    connected = fd != -1;
+    pthread_mutex_unlock(&log_lock);
+    if (fd == -1) return NULL;  // Stopped before any primary connected
+
+    uint8_t *buf = malloc(REPL_RECV_SIZE);
+    size_t len = 0;
+    ssize_t n;
+    while (buf && (n = recv(fd, buf + len, REPL_RECV_SIZE - len, 0)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Replication stream failed");
+            atomic_store(&broken, 1);
+            break;
+        }
+        atomic_fetch_add_explicit(&bytes, (uint64_t)n, memory_order_relaxed);
+        len += (size_t)n;
+        size_t used = apply_records(buf, len);
+        memmove(buf, buf + used, len - used);
+        len -= used;
+    }
+    if (len > 0) {
+        fprintf(stderr, "Replication stream ended in the middle of a record\n");
+        atomic_store(&broken, 1);
+    }
+    free(buf);
+    return NULL;
+}
+
+int repl_follower_start(HashTable *ht, const char *socket_path) {
+    if (role != REPL_NONE || set_address(socket_path) != 0) return 1;
+    listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_sock == -1) {
+        perror("Failed to create replication socket");
+        return 1;
+    }
+    unlink(socket_path);
+    if (bind(listen_sock, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listen_sock, 1) != 0) {
+        perror("Failed to listen for a primary");
+        close(listen_sock);
+        listen_sock = -1;
+        return 1;
+    }
+    table = ht;
+    if (pthread_create(&thread, NULL, receiver_func, NULL) != 0) {
+        perror("Failed to start replication");
+        close(listen_sock);
+        listen_sock = -1;
+        unlink(socket_path);
+        return 1;
+    }
+    role = REPL_FOLLOWER;
+    return 0;
+}
+
+void repl_stop() {
+    if (role == REPL_PRIMARY) {
+        pthread_mutex_lock(&log_lock);
+        stopping = 1;
+        pthread_cond_signal(&log_ready);
+        pthread_mutex_unlock(&log_lock);
+        pthread_join(thread, NULL);
+        set_commit_hook(table, NULL, NULL, NULL);
+        close(sock);
+    } else if (role == REPL_FOLLOWER) {
+        // A follower nobody connected to has nothing left to wait for
+        pthread_mutex_lock(&log_lock);
+        if (!connected) shutdown(listen_sock, SHUT_RDWR);
+        pthread_mutex_unlock(&log_lock);
+        pthread_join(thread, NULL);
+        if (sock != -1) close(sock);
+        close(listen_sock);
+        unlink(address.sun_path);
+    } else {
+        return;
+    }
+    free(log_buf.data);
+    free(send_buf.data);
+    log_buf = send_buf = (LogBuffer){NULL, 0, 0};
+    sock = listen_sock = -1;
+    role = REPL_NONE;
+}
+
+void repl_stats(ReplStats *stats) {
+    pthread_mutex_lock(&log_lock);
+    stats->role = role;
+    stats->pending_bytes = log_buf.len + in_flight;
+    pthread_mutex_unlock(&log_lock);
+    stats->records = atomic_load(&records);
+    stats->bytes = atomic_load(&bytes);
+    stats->last_lag_ns = atomic_load(&last_lag_ns);
+    stats->max_lag_ns = atomic_load(&max_lag_ns);
+    stats->broken = atomic_load(&broken);
+}
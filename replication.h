@@ -0,0 +1,49 @@
+#ifndef KVS_REPLICATION_H
+#define KVS_REPLICATION_H
+
+#include <stdint.h>
+
+#include "kvs.h"
+
+/// Streaming replication to a hot standby. The primary appends every write
+/// and every removal, evictions and expirations included, to an in-memory
+/// log while it holds the key's bucket lock, so the log has the primary's
+/// per-key commit order. A sender thread ships the log in large writes over
+/// a UNIX socket. The follower applies the records
+/// to its own table as they arrive, and can serve reads meanwhile.
+
+typedef struct ReplStats {
+    int role;                  // REPL_NONE, REPL_PRIMARY or REPL_FOLLOWER
+    uint64_t records;          // Logged by the primary, applied by the follower
+    uint64_t bytes;            // Sent or received
+    uint64_t pending_bytes;    // Primary: logged but not sent yet
+    uint64_t last_lag_ns;      // Follower: commit on the primary to apply
+    uint64_t max_lag_ns;
+    int broken;                // The connection failed; replication stopped
+} ReplStats;
+
+enum { REPL_NONE, REPL_PRIMARY, REPL_FOLLOWER };
+
+/// Connects to a follower listening on socket_path and starts streaming.
+/// Waits a few seconds for the follower to come up.
+/// @param ht Table whose mutations are streamed.
+/// @param socket_path Path of the follower's UNIX socket.
+/// @return 0 if streaming started, 1 otherwise.
+int repl_primary_start(HashTable *ht, const char *socket_path);
+
+/// Listens on socket_path and applies the stream of the first primary that
+/// connects.
+/// @param ht Table the stream is applied to.
+/// @param socket_path Path of the UNIX socket to create.
+/// @return 0 if the follower is listening, 1 otherwise.
+int repl_follower_start(HashTable *ht, const char *socket_path);
+
+/// Primary: sends what is left of the log and closes the stream.
+/// Follower: applies the stream until the primary closes it.
+void repl_stop();
+
+/// Reads the replication counters.
+/// @param stats Where to store them.
+void repl_stats(ReplStats *stats);
+
+#endif  // KVS_REPLICATION_H
@@ -0,0 +1,364 @@
+#include "scheduler.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "trace.h"
+
+#define TUNE_INTERVAL_MS 100
+#define CONTENTION_SHARE 0.20  // Share of worker time blocked on locks that calls for fewer workers
+#define REGRESSION 0.90        // Throughput below this share of the last interval undoes a grow
+#define HOLD_INTERVALS 10      // Intervals without growing after a grow was undone
+
+enum { TASK_READY, TASK_RUNNING, TASK_PARKED, TASK_DONE };
+
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond;
+
+static SchedTask *run_head = NULL, *run_tail = NULL;
+static TimerWheel wheel;
+
+static SchedTask **tasks = NULL;  // Every submitted task, indexed by id - 1
+static unsigned int num_tasks = 0, tasks_capacity = 0;
+static unsigned int unfinished = 0;
+static int closed = 0;
+
+static pthread_t *workers = NULL;
+static unsigned int num_workers_started = 0;
+static sched_step_fn step_fn = NULL;
+static sched_done_fn done_fn = NULL;
+
+// Adaptive sizing. Workers with an index at or above active_workers sleep on
+// gate_cond, so that they never swallow a wake-up meant for a running worker;
+// a shrink wakes the idle ones so that they move there.
+// Written with sched_mutex held; running tasks read it to know when to yield.
+static atomic_uint active_workers = 0;
+static _Thread_local unsigned int worker_index = 0;
+static unsigned int num_ready = 0, num_running = 0;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static sched_probe_fn lock_wait_probe = NULL;
+static atomic_uint_fast64_t ops_done = 0;
+static pthread_cond_t tune_cond;   // Only the tuner sleeps on it
+static pthread_t tuner;
+static int tuner_started = 0, tuner_stopping = 0;
+
+static void push_ready(SchedTask *task) {
+    num_ready++;
+    task->state = TASK_READY;
+    task->next = NULL;
+    if (run_tail)
+        run_tail->next = task;
+    else
+        run_head = task;
+    run_tail = task;
+}
+
+static SchedTask *pop_ready() {
+    SchedTask *task = run_head;
+    if (task) {
+        num_ready--;
+        run_head = task->next;
+        if (!run_head)
+            run_tail = NULL;
+    }
+    return task;
+}
+
+static void park(SchedTask *task, uint64_t wake_at) {
+    task->state = TASK_PARKED;
+    tw_add(&wheel, &task->timer, wake_at);
+}
+
+// Moves the tasks whose wait is over to the run queue. Called with sched_mutex held.
+static void wake_expired() {
+    TimerNode *timer = tw_advance(&wheel, monotonic_ms(), 0);
+    while (timer) {
+        TimerNode *next = timer->next;
+        push_ready(TW_CONTAINER_OF(timer, SchedTask, timer));
+        timer = next;
+    }
+}
+
+static void *worker_func(void *arg) {
+    unsigned int index = (unsigned int)(uintptr_t)arg;
+    worker_index = index;
+    affinity_pin_worker(index);
+    trace_thread_name("worker");
+    pthread_mutex_lock(&sched_mutex);
+    for (;;) {
+        if (index >= active_workers && !(closed && unfinished == 0)) {
+            pthread_cond_wait(&gate_cond, &sched_mutex);
+            continue;
+        }
+        wake_expired();
+        SchedTask *task = pop_ready();
+        if (task) {
+            // Delays requested while the task was queued are served before it runs
+            unsigned int delay = sched_take_delay(task);
+            if (delay > 0) {
+                park(task, monotonic_ms() + delay);
+                continue;
+            }
+            task->state = TASK_RUNNING;
+            num_running++;
+            pthread_mutex_unlock(&sched_mutex);
+
+            int again = step_fn(task, &delay);
+
+            pthread_mutex_lock(&sched_mutex);
+            num_running--;
+            if (again) {
+                park(task, monotonic_ms() + delay);
+                // Another idle worker may have to shorten its sleep
+                pthread_cond_signal(&sched_cond);
+            } else {
+                task->state = TASK_DONE;
+                if (task->id <= tasks_capacity)
+                    tasks[task->id - 1] = NULL;
+                if (--unfinished == 0 && closed) {
+                    pthread_cond_broadcast(&sched_cond);
+                    pthread_cond_broadcast(&gate_cond);
+                }
+                pthread_mutex_unlock(&sched_mutex);
+                done_fn(task);
+                pthread_mutex_lock(&sched_mutex);
+            }
+            continue;
+        }
+
+        if (closed && unfinished == 0)
+            break;
+
+        uint64_t next = tw_next_expiry(&wheel);
+        if (next == UINT64_MAX) {
+            pthread_cond_wait(&sched_cond, &sched_mutex);
+        } else {
+            struct timespec ts = {(time_t)(next / 1000u), (long)(next % 1000u) * 1000000L};
+            pthread_cond_timedwait(&sched_cond, &sched_mutex, &ts);
+        }
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return NULL;
+}
+
+void sched_set_adaptive(sched_probe_fn lock_wait) {
+    lock_wait_probe = lock_wait;
+}
+
+void sched_note_ops(unsigned int n) {
+    atomic_fetch_add_explicit(&ops_done, n, memory_order_relaxed);
+}
+
+// Hill climbing on the number of active workers. Grows while tasks queue up
+// and the last grow paid off, shrinks when workers spend their time blocked
+// on locks or a grow made throughput drop. Called with sched_mutex held.
+static void tune(double interval_ms, uint64_t ops, uint64_t lock_wait_ns) {
+    static int last_change = 0;
+    static double last_rate = 0;
+    static int hold = 0;
+
+    double rate = (double)ops * 1000.0 / interval_ms;
+    double wait_share = (double)lock_wait_ns / (interval_ms * 1e6 * active_workers);
+    unsigned int target = active_workers;
+    const char *reason = NULL;
+
+    if (last_change > 0 && num_ready > 0 && rate < last_rate * REGRESSION && active_workers > 1) {
+        target--;
+        reason = "throughput fell after growing";
+        hold = HOLD_INTERVALS;
+    } else if (wait_share > CONTENTION_SHARE && active_workers > 1) {
+        target--;
+        reason = "workers blocked on locks";
+        hold = HOLD_INTERVALS;
+    } else if (hold > 0) {
+        hold--;
+    } else if (num_ready > 0 && active_workers < num_workers_started) {
+        target++;
+        reason = "tasks waiting for a worker";
+    }
+
+    int change = (int)target - (int)active_workers;
+    if (change != 0) {
+        fprintf(stderr, "sched: %u -> %u workers (%s: %.0f ops/s, %u queued, %u running, %.1f%% lock wait)\n",
+                active_workers, target, reason, rate, num_ready, num_running, wait_share * 100.0);
+        active_workers = target;
+        if (change > 0) {
+            pthread_cond_broadcast(&gate_cond);
+        } else {
+            // Deactivated workers idle on sched_cond would swallow wake-ups
+            // meant for the active ones: send them to gate_cond now
+            pthread_cond_broadcast(&sched_cond);
+        }
+    }
+    last_change = change;
+    last_rate = rate;
+}
+
+static void *tuner_func(void *arg) {
+    (void)arg;
+    uint64_t last_ms = monotonic_ms();
+    uint64_t last_ops = atomic_load(&ops_done), last_wait = lock_wait_probe();
+    pthread_mutex_lock(&sched_mutex);
+    while (!tuner_stopping) {
+        uint64_t wake_at = last_ms + TUNE_INTERVAL_MS;
+        struct timespec ts = {(time_t)(wake_at / 1000u), (long)(wake_at % 1000u) * 1000000L};
+        pthread_cond_timedwait(&tune_cond, &sched_mutex, &ts);
+        uint64_t now = monotonic_ms();
+        if (tuner_stopping || now < wake_at)
+            continue;
+        uint64_t ops = atomic_load(&ops_done), wait = lock_wait_probe();
+        tune((double)(now - last_ms), ops - last_ops, wait - last_wait);
+        last_ms = now;
+        last_ops = ops;
+        last_wait = wait;
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return NULL;
+}
+
+int sched_should_yield() {
+    return worker_index >= atomic_load_explicit(&active_workers, memory_order_relaxed);
+}
+
+int sched_start(unsigned int num_workers, sched_step_fn step, sched_done_fn done) {
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0 ||
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+        pthread_cond_init(&sched_cond, &attr) != 0) {
+        fprintf(stderr, "Failed to initialize the scheduler\n");
+        return 1;
+    }
+    if (lock_wait_probe && pthread_cond_init(&tune_cond, &attr) != 0) {
+        fprintf(stderr, "Failed to initialize the scheduler\n");
+        pthread_cond_destroy(&sched_cond);
+        return 1;
+    }
+    pthread_condattr_destroy(&attr);
+
+    tw_init(&wheel, monotonic_ms());
+    step_fn = step;
+    done_fn = done;
+    // Adaptive pools start with one worker per CPU and tune from there
+    active_workers = num_workers;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (lock_wait_probe && cpus > 0 && (unsigned long)cpus < num_workers)
+        active_workers = (unsigned int)cpus;
+    workers = malloc(sizeof(pthread_t) * num_workers);
+    if (!workers) {
+        perror("Failed to allocate workers");
+        pthread_cond_destroy(&sched_cond);
+        if (lock_wait_probe)
+            pthread_cond_destroy(&tune_cond);
+        return 1;
+    }
+    for (num_workers_started = 0; num_workers_started < num_workers; num_workers_started++) {
+        if (pthread_create(&workers[num_workers_started], NULL, worker_func, (void *)(uintptr_t)num_workers_started) != 0) {
+            perror("Failed to create worker");
+            break;
+        }
+    }
+    if (num_workers_started == 0) {
+        free(workers);
+        pthread_cond_destroy(&sched_cond);
+        if (lock_wait_probe)
+            pthread_cond_destroy(&tune_cond);
+        return 1;
+    }
+    pthread_mutex_lock(&sched_mutex);
+    if (active_workers > num_workers_started)
+        active_workers = num_workers_started;
+    pthread_mutex_unlock(&sched_mutex);
+    if (lock_wait_probe) {
+        tuner_stopping = 0;
+        if (pthread_create(&tuner, NULL, tuner_func, NULL) == 0) {
+            tuner_started = 1;
+        } else {
+            // Without the tuner every worker stays active
+            perror("Failed to start the worker tuner");
+            pthread_mutex_lock(&sched_mutex);
+            active_workers = num_workers_started;
+            pthread_mutex_unlock(&sched_mutex);
+        }
+    }
+    return 0;
+}
+
+void sched_submit(SchedTask *task) {
+    pthread_mutex_lock(&sched_mutex);
+    if (num_tasks == tasks_capacity) {
+        unsigned int capacity = tasks_capacity ? tasks_capacity * 2 : 64;
+        SchedTask **grown = realloc(tasks, sizeof(SchedTask *) * capacity);
+        if (!grown) {
+            // Still runs, it just cannot be the target of a WAIT
+            perror("Failed to register task");
+        } else {
+            for (unsigned int i = tasks_capacity; i < capacity; i++)
+                grown[i] = NULL;
+            tasks = grown;
+            tasks_capacity = capacity;
+        }
+    }
+    task->id = ++num_tasks;
+    if (task->id <= tasks_capacity)
+        tasks[task->id - 1] = task;
+    atomic_init(&task->pending_delay_ms, 0);
+    unfinished++;
+    push_ready(task);
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+int sched_delay(unsigned int id, unsigned int delay_ms) {
+    int result = 1;
+    pthread_mutex_lock(&sched_mutex);
+    SchedTask *task = (id >= 1 && id <= num_tasks && id <= tasks_capacity) ? tasks[id - 1] : NULL;
+    if (task) {
+        if (task->state == TASK_PARKED) {
+            uint64_t wake_at = task->timer.expires + delay_ms;
+            tw_del(&wheel, &task->timer);
+            tw_add(&wheel, &task->timer, wake_at);
+            result = 0;
+        } else {
+            atomic_fetch_add(&task->pending_delay_ms, delay_ms);
+            result = 0;
+        }
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return result;
+}
+
+unsigned int sched_take_delay(SchedTask *task) {
+    return atomic_exchange(&task->pending_delay_ms, 0);
+}
+
+void sched_finish() {
+    pthread_mutex_lock(&sched_mutex);
+    closed = 1;
+    pthread_cond_broadcast(&sched_cond);
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&sched_mutex);
+
+    for (unsigned int i = 0; i < num_workers_started; i++)
+        pthread_join(workers[i], NULL);
+    if (tuner_started) {
+        pthread_mutex_lock(&sched_mutex);
+        tuner_stopping = 1;
+        pthread_cond_signal(&tune_cond);
+        pthread_mutex_unlock(&sched_mutex);
+        pthread_join(tuner, NULL);
+        tuner_started = 0;
+    }
+    if (lock_wait_probe)
+        pthread_cond_destroy(&tune_cond);
+    free(workers);
+    free(tasks);
+    workers = NULL;
+    tasks = NULL;
+    num_tasks = tasks_capacity = num_workers_started = 0;
+    pthread_cond_destroy(&sched_cond);
+}
@@ -0,0 +1,74 @@
+#ifndef KVS_SCHEDULER_H
+#define KVS_SCHEDULER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "timer_wheel.h"
+
+/// Resumable unit of work run by the worker pool. Embed it as the first member
+/// of the job structure handed to the step function.
+typedef struct SchedTask {
+    struct SchedTask *next;              // Run queue link
+    TimerNode timer;                     // Armed while the task is parked
+    unsigned int id;                     // 1-based, in order of submission
+    int state;                           // Owned by the scheduler
+    atomic_uint pending_delay_ms;        // Delay requested by other tasks
+} SchedTask;
+
+/// Runs a task until it finishes or has to wait.
+/// @param task Task to run.
+/// @param delay_ms Where to store the delay when the task has to wait.
+/// @return 0 if the task finished, 1 if it must be resumed after *delay_ms.
+typedef int (*sched_step_fn)(SchedTask *task, unsigned int *delay_ms);
+
+/// Called once a task has finished; the task is no longer referenced by the
+/// scheduler and may be freed.
+/// @param task Finished task.
+typedef void (*sched_done_fn)(SchedTask *task);
+
+/// Reads a counter of time spent blocked, in nanoseconds.
+typedef uint64_t (*sched_probe_fn)();
+
+/// Makes the next sched_start adaptive: num_workers becomes a ceiling and the
+/// number of active workers follows throughput, run-queue length and lock
+/// wait time. Each change is logged to stderr.
+/// @param lock_wait Counter of time workers spent blocked on locks.
+void sched_set_adaptive(sched_probe_fn lock_wait);
+
+/// Counts operations done by a task, the throughput the tuner maximizes.
+/// @param n Number of operations.
+void sched_note_ops(unsigned int n);
+
+/// Tells a running task that its worker was deactivated. The task should
+/// return from the step function, asking to be resumed with no delay.
+/// @return 1 if the task should yield its worker, 0 otherwise.
+int sched_should_yield();
+
+/// Starts the worker pool.
+/// @param num_workers Number of worker threads.
+/// @param step Function that runs a task.
+/// @param done Function called when a task finishes.
+/// @return 0 if the pool was started successfully, 1 otherwise.
+int sched_start(unsigned int num_workers, sched_step_fn step, sched_done_fn done);
+
+/// Queues a task to be run. Assigns the task id.
+/// @param task Task to queue, must stay valid until it is handed to done.
+void sched_submit(SchedTask *task);
+
+/// Delays another task. If the task is waiting the delay is added to its
+/// wake-up time, otherwise it waits before running its next command.
+/// @param id Id of the task to delay.
+/// @param delay_ms Delay in milliseconds.
+/// @return 0 if the task was delayed, 1 if no running task has that id.
+int sched_delay(unsigned int id, unsigned int delay_ms);
+
+/// Takes the delay that other tasks requested for this one.
+/// @param task Running task.
+/// @return Delay in milliseconds, 0 if none.
+unsigned int sched_take_delay(SchedTask *task);
+
+/// Waits for every submitted task to finish and stops the worker pool.
+void sched_finish();
+
+#endif  // KVS_SCHEDULER_H
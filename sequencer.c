@@ -0,0 +1,218 @@
+#include "sequencer.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timer_wheel.h"
+
+#define SEQ_HEADER "kvs-schedule 1"
+
+int seq_mode = SEQ_OFF;
+
+static pthread_mutex_t seq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t seq_turn;       // Signalled whenever the replay moves on
+
+static char **names = NULL;           // Indexed by actor id
+static char *finished = NULL;
+static size_t num_actors = 0, actors_capacity = 0;
+
+static uint32_t *ops = NULL;          // Actor of each operation, in order
+static size_t num_ops = 0, ops_capacity = 0;
+static size_t next_op = 0;            // Replay: operation whose turn it is
+static int diverged = 0, failed = 0;
+static const char *record_path = NULL;
+
+static int init_turn() {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int result = pthread_cond_init(&seq_turn, &attr);
+    pthread_condattr_destroy(&attr);
+    return result != 0;
+}
+
+// Adds an actor name. Called with seq_lock held, or before any thread runs.
+static int add_actor(const char *name) {
+    if (num_actors == actors_capacity) {
+        size_t capacity = actors_capacity ? actors_capacity * 2 : 64;
+        char **grown_names = realloc(names, capacity * sizeof(char *));
+        if (!grown_names) return -1;
+        names = grown_names;
+        char *grown_finished = realloc(finished, capacity);
+        if (!grown_finished) return -1;
+        finished = grown_finished;
+        actors_capacity = capacity;
+    }
+    if (!(names[num_actors] = strdup(name))) return -1;
+    finished[num_actors] = 0;
+    return (int)num_actors++;
+}
+
+static int add_op(uint32_t actor) {
+    if (num_ops == ops_capacity) {
+        size_t capacity = ops_capacity ? ops_capacity * 2 : 4096;
+        uint32_t *grown = realloc(ops, capacity * sizeof(uint32_t));
+        if (!grown) return 1;
+        ops = grown;
+        ops_capacity = capacity;
+    }
+    ops[num_ops++] = actor;
+    return 0;
+}
+
+// From here on the replay runs freely; the files it writes may differ.
+static void diverge(const char *reason) {
+    if (!diverged) {
+        fprintf(stderr, "replay: diverged at operation %zu of %zu: %s\n", next_op, num_ops, reason);
+    }
+    diverged = 1;
+    pthread_cond_broadcast(&seq_turn);
+}
+
+int seq_record(const char *path) {
+    if (init_turn() != 0) return 1;
+    record_path = path;
+    seq_mode = SEQ_RECORD;
+    return 0;
+}
+
+int seq_replay(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        perror("Error opening schedule");
+        return 1;
+    }
+    char *line = NULL;
+    size_t line_cap = 0, count = 0;
+    ssize_t len;
+    int ok = getline(&line, &line_cap, in) > 0 && strncmp(line, SEQ_HEADER "\n", sizeof(SEQ_HEADER)) == 0 &&
+             fscanf(in, "actors %zu\n", &count) == 1;
+    for (size_t i = 0; ok && i < count; i++) {
+        ok = (len = getline(&line, &line_cap, in)) > 1 && line[len - 1] == '\n';
+        if (ok) {
+            line[len - 1] = '\0';
+            ok = add_actor(line) >= 0;
+        }
+    }
+    ok = ok && fscanf(in, "ops %zu\n", &count) == 1;
+    for (size_t i = 0; ok && i < count; i++) {
+        unsigned int actor;
+        ok = fscanf(in, "%u\n", &actor) == 1 && actor < num_actors && add_op(actor) == 0;
+    }
+    free(line);
+    fclose(in);
+    if (!ok || init_turn() != 0) {
+        fprintf(stderr, "Invalid schedule: %s\n", path);
+        return 1;
+    }
+    seq_mode = SEQ_REPLAY;
+    return 0;
+}
+
+int seq_actor(const char *name) {
+    pthread_mutex_lock(&seq_lock);
+    for (size_t i = 0; i < num_actors; i++) {
+        if (strcmp(names[i], name) == 0) {
+            pthread_mutex_unlock(&seq_lock);
+            return (int)i;
+        }
+    }
+    if (seq_mode == SEQ_REPLAY) diverge("actor not in the schedule");
+    int actor = add_actor(name);
+    if (actor < 0) {
+        failed = 1;
+        if (seq_mode == SEQ_REPLAY) diverge("out of memory");
+    }
+    pthread_mutex_unlock(&seq_lock);
+    return actor;
+}
+
+void seq_actor_done(int actor) {
+    if (seq_mode != SEQ_REPLAY || actor < 0) return;
+    pthread_mutex_lock(&seq_lock);
+    finished[actor] = 1;
+    pthread_cond_broadcast(&seq_turn);
+    pthread_mutex_unlock(&seq_lock);
+}
+
+int seq_enter(int actor, unsigned int timeout_ms) {
+    pthread_mutex_lock(&seq_lock);
+    if (seq_mode == SEQ_RECORD) {
+        // Released by seq_leave, so operations run one at a time in log order
+        if (actor < 0 || add_op((uint32_t)actor) != 0) failed = 1;
+        return 0;
+    }
+
+    uint64_t deadline = timeout_ms == SEQ_FOREVER ? 0 : monotonic_ms() + timeout_ms;
+    while (!diverged) {
+        if (actor < 0) {
+            diverge("unknown actor");
+        } else if (next_op == num_ops) {
+            diverge("the schedule has no more operations");
+        } else if (ops[next_op] == (uint32_t)actor) {
+            break;
+        } else if (finished[ops[next_op]]) {
+            diverge("the next operation belongs to an actor that already finished");
+        } else if (deadline == 0) {
+            pthread_cond_wait(&seq_turn, &seq_lock);
+        } else if (monotonic_ms() >= deadline) {
+            pthread_mutex_unlock(&seq_lock);
+            return 1;
+        } else {
+            struct timespec ts = {(time_t)(deadline / 1000u), (long)(deadline % 1000u) * 1000000L};
+            pthread_cond_timedwait(&seq_turn, &seq_lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&seq_lock);
+    return 0;
+}
+
+void seq_leave() {
+    if (seq_mode == SEQ_RECORD) {
+        pthread_mutex_unlock(&seq_lock);
+        return;
+    }
+    pthread_mutex_lock(&seq_lock);
+    if (!diverged) {
+        next_op++;
+        pthread_cond_broadcast(&seq_turn);
+    }
+    pthread_mutex_unlock(&seq_lock);
+}
+
+int seq_finish() {
+    int result = failed;
+    if (seq_mode == SEQ_RECORD && !failed) {
+        FILE *out = fopen(record_path, "w");
+        if (!out) {
+            perror("Error writing schedule");
+            result = 1;
+        } else {
+            fprintf(out, SEQ_HEADER "\nactors %zu\n", num_actors);
+            for (size_t i = 0; i < num_actors; i++) fprintf(out, "%s\n", names[i]);
+            fprintf(out, "ops %zu\n", num_ops);
+            for (size_t i = 0; i < num_ops; i++) fprintf(out, "%u\n", ops[i]);
+            result = fclose(out) != 0;
+        }
+    } else if (seq_mode == SEQ_RECORD) {
+        fprintf(stderr, "Schedule incomplete, not written\n");
+    } else if (seq_mode == SEQ_REPLAY) {
+        if (!diverged && next_op != num_ops) diverge("the run ended before the schedule");
+        result = diverged;
+    }
+    if (seq_mode != SEQ_OFF) pthread_cond_destroy(&seq_turn);
+    for (size_t i = 0; i < num_actors; i++) free(names[i]);
+    free(names);
+    free(finished);
+    free(ops);
+    names = NULL;
+    finished = NULL;
+    ops = NULL;
+    num_actors = actors_capacity = num_ops = ops_capacity = next_op = 0;
+    seq_mode = SEQ_OFF;
+    return result;
+}
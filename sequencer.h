@@ -0,0 +1,48 @@
+#ifndef KVS_SEQUENCER_H
+#define KVS_SEQUENCER_H
+
+/// Record and replay of the global order of table operations. Recording runs
+/// operations one at a time and logs which actor (a job) ran each one; a
+/// backup is ordered by the snapshot its job takes. Replaying lets each operation run only when it is
+/// its actor's turn in the log, so every replay sees the same interleaving
+/// and writes the same files.
+
+enum { SEQ_OFF, SEQ_RECORD, SEQ_REPLAY };
+
+#define SEQ_FOREVER 0u
+
+extern int seq_mode;
+
+/// Starts recording. The log is written by seq_finish.
+/// @param path File to write the log to.
+/// @return 0 on success, 1 otherwise.
+int seq_record(const char *path);
+
+/// Loads a recorded log to replay.
+/// @param path File to read the log from.
+/// @return 0 on success, 1 otherwise.
+int seq_replay(const char *path);
+
+/// Registers an actor by a name that is stable across runs.
+/// @param name Name of the actor, such as the job file name.
+/// @return Actor id.
+int seq_actor(const char *name);
+
+/// Marks an actor as finished; a replay waiting on it has diverged.
+/// @param actor Actor id.
+void seq_actor_done(int actor);
+
+/// Waits for the actor's turn to run an operation.
+/// @param actor Actor id.
+/// @param timeout_ms Longest wait in milliseconds, SEQ_FOREVER to wait for the turn.
+/// @return 0 once it is the actor's turn, 1 if the wait timed out.
+int seq_enter(int actor, unsigned int timeout_ms);
+
+/// Ends the operation started by seq_enter.
+void seq_leave();
+
+/// Writes the recorded log or checks that the replay followed it to the end.
+/// @return 0 on success, 1 if the log could not be written or the replay diverged.
+int seq_finish();
+
+#endif  // KVS_SEQUENCER_H
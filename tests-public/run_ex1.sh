@@ -19,9 +19,23 @@ run_test() {
 
     cp "$file" "$temp_dir"
 
-    local cmd="$kvs_binary $temp_dir 1 1" #single threaded
+    # Options for the test, if any, are in a .args file next to the job
+    local args=""
+    if [ -f "$test_dir/$filename.args" ]; then
+        args=$(cat "$test_dir/$filename.args")
+    fi
+
+    # Jobs run again, in the same directory, as many times as a .runs file says
+    local runs=1
+    if [ -f "$test_dir/$filename.runs" ]; then
+        runs=$(cat "$test_dir/$filename.runs")
+    fi
+
+    local cmd="$kvs_binary $args $temp_dir 1 1" #single threaded
 
-    eval "./$cmd"
+    for ((run = 0; run < runs; run++)); do
+        eval "./$cmd"
+    done
 
     local output_file
     output_file="${temp_dir}/${filename}.out"
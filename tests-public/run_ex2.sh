@@ -5,20 +5,31 @@ if [ -z "$1" ]; then
 fi
 executable=$1
 
+# Folders without backups have no .bck files to check, and jobs run with
+# -r write their files in subfolders
+shopt -s nullglob globstar
+
 test_dir="tests-public/jobs2"
 results_dir="tests-public/results2"
 
 # Run executable and check results
 for job_folder in "$test_dir"/*/; do
-    echo -e "\e[34mRunning executable: $executable $job_folder 1 2 \e[0m"
-    if ! ./"$executable" "$job_folder" 1 2; then
+    # Options for the folder, if any, are in a .args file next to it
+    args=""
+    if [ -f "${job_folder%/}.args" ]; then
+        args=$(cat "${job_folder%/}.args")
+    fi
+
+    echo -e "\e[34mRunning executable: $executable $args $job_folder 1 2 \e[0m"
+    if ! eval "./$executable $args $job_folder 1 2"; then
         echo -e "\e[31mExecutable failed\e[0m"
         exit 1
     fi
 
-    # Iterate over each .out file in the generated output directory
-    for output_file in "${job_folder}"*.out; do
-        filename=$(basename "$output_file" .out)
+    # Iterate over each .out file in the generated output directory and below
+    for output_file in "${job_folder}"**/*.out; do
+        filename=${output_file#"$job_folder"}
+        filename=${filename%.out}
         result=$(echo "$job_folder" | awk -F'/' '{print $(NF-1)}')
         result_file="${results_dir}/${result}/${filename}.result"
         echo "${result_file}"
@@ -35,15 +46,25 @@ for job_folder in "$test_dir"/*/; do
         fi
     done
 
-    for output_file in "${job_folder}"*.bck; do
-        filename=$(basename "$output_file" .bck)
+    for output_file in "${job_folder}"**/*.bck; do
+        filename=${output_file#"$job_folder"}
+        filename=${filename%.bck}
         result=$(echo "$job_folder" | awk -F'/' '{print $(NF-1)}')
         result_file="${results_dir}/${result}/${filename}.bck"
         echo "${result_file}"
 
+        # Backups compressed with -z are compared by their contents
+        contents="$output_file"
+        if [[ "$(head -c 4 "$output_file")" == "KVSZ" ]]; then
+            contents=$(mktemp)
+            if ! ./"$executable" -X "$output_file" > "$contents"; then
+                echo -e "\e[31mCould not extract $output_file\e[0m"
+            fi
+        fi
+
         # Check the result file
         if [[ -f "$result_file" ]]; then
-            if diff "$output_file" "$result_file"; then
+            if diff "$contents" "$result_file"; then
                 echo -e "\e[32mTest passed for $filename in $job_folder\e[0m"
             else
                 echo -e "\e[31mTest failed for $filename in $job_folder\e[0m"
@@ -51,5 +72,8 @@ for job_folder in "$test_dir"/*/; do
         else
             echo -e "\e[33mResult file not found for $filename in $job_folder\e[0m"
         fi
+        if [[ "$contents" != "$output_file" ]]; then
+            rm -f "$contents"
+        fi
     done
 done
@@ -0,0 +1,56 @@
+// Checks that timers fire exactly on their expiry tick, for expiries around
+// the boundaries between the levels of the wheel.
+#include "../../timer_wheel.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+static int failures = 0;
+
+// Arms one timer at start + offset and advances the wheel up to it, first
+// in a single call up to the tick before and then one tick at a time.
+static void check(uint64_t start, uint64_t offset, uint64_t step) {
+    TimerWheel tw;
+    TimerNode timer, other;
+    tw_init(&tw, start);
+    tw_add(&tw, &timer, start + offset);
+    // A second timer keeps the wheel from skipping ahead when it is otherwise empty
+    tw_add(&tw, &other, UINT64_MAX);
+
+    uint64_t now = start;
+    uint64_t fired = 0;
+    while (now < start + offset + 2 * TW_SLOTS && fired == 0) {
+        now += step;
+        if (now > start + offset && now - step < start + offset) now = start + offset;
+        TimerNode *expired = tw_advance(&tw, now, 0);
+        if (expired == &timer) fired = now;
+        else if (expired != NULL) break;
+    }
+    if (fired != start + offset) {
+        fprintf(stderr, "timer armed at %llu for %llu fired at %llu\n", (unsigned long long)start,
+                (unsigned long long)(start + offset), (unsigned long long)fired);
+        failures++;
+    }
+}
+
+int main() {
+    static const uint64_t starts[] = {0, 1, 62, 63, 64, 65, 4031, 4095, 4096, 4097, 262143, 262144};
+    static const uint64_t offsets[] = {1,    2,    63,   64,   65,   127,  128,    129,    4031,
+                                       4032, 4095, 4096, 4097, 8191, 8192, 262143, 262144, 262145};
+    static const uint64_t steps[] = {1, 7, 64, 1000};
+
+    for (size_t s = 0; s < sizeof(starts) / sizeof(starts[0]); s++) {
+        for (size_t o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++) {
+            for (size_t t = 0; t < sizeof(steps) / sizeof(steps[0]); t++) {
+                check(starts[s], offsets[o], steps[t]);
+            }
+        }
+    }
+
+    if (failures != 0) {
+        fprintf(stderr, "timer wheel: %d failures\n", failures);
+        return 1;
+    }
+    printf("timer wheel: all expiries fired on time\n");
+    return 0;
+}
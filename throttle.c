@@ -0,0 +1,129 @@
+#define _GNU_SOURCE  // syscall
+#include "throttle.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define THROTTLE_CHUNK (64u << 10)       // Largest write charged at once
+#define THROTTLE_BURST_DIVISOR 10        // Buckets hold a tenth of a second of budget
+#define GENTLE_FLUSH_BYTES (8u << 20)    // Pages dropped from the cache this often
+
+// Lowest priority of the best-effort class. The idle class could stall
+// backups for as long as the jobs keep the disk busy.
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_LOWEST ((IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7)
+
+typedef struct TokenBucket {
+    double rate;              // Tokens per second, 0 for no limit
+    double burst;
+    double tokens;            // Negative while a write is being paid off
+    uint64_t last_ns;
+} TokenBucket;
+
+static TokenBucket bandwidth = {0, 0, 0, 0}, operations = {0, 0, 0, 0};
+static int gentle = 0;
+static size_t unflushed = 0;          // Bytes written since the cache was last dropped
+static uint64_t backup_start = 0;
+
+static atomic_uint_fast64_t backups = 0, bytes = 0, writes = 0, busy_ns = 0, throttled_ns = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void bucket_init(TokenBucket *bucket, uint64_t rate) {
+    bucket->rate = (double)rate;
+    bucket->burst = bucket->rate / THROTTLE_BURST_DIVISOR;
+    if (bucket->burst < 1.0) bucket->burst = 1.0;
+    bucket->tokens = bucket->burst;
+    bucket->last_ns = now_ns();
+}
+
+// Takes tokens, going into debt if needed, and returns how long to sleep
+// until the debt is paid.
+static uint64_t bucket_take(TokenBucket *bucket, double amount, uint64_t now) {
+    if (bucket->rate <= 0) return 0;
+    bucket->tokens += bucket->rate * (double)(now - bucket->last_ns) / 1e9;
+    if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+    bucket->last_ns = now;
+    bucket->tokens -= amount;
+    return bucket->tokens < 0 ? (uint64_t)(-bucket->tokens / bucket->rate * 1e9) : 0;
+}
+
+void throttle_configure(uint64_t bytes_per_sec, uint64_t iops, int gentle_io) {
+    bucket_init(&bandwidth, bytes_per_sec);
+    bucket_init(&operations, iops);
+    gentle = gentle_io;
+}
+
+void throttle_backup_thread() {
+    if (!gentle) return;
+#ifdef SYS_ioprio_set
+    // With who 0 the priority applies to the calling thread only
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_LOWEST) != 0) perror("Failed to lower backup I/O priority");
+#endif
+}
+
+void throttle_begin() {
+    backup_start = now_ns();
+    unflushed = 0;
+}
+
+// Writes the dirty pages out and drops them, so the backup does not push
+// data the jobs still read out of the page cache.
+static void drop_pages(int fd) {
+    if (fdatasync(fd) != 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    unflushed = 0;
+}
+
+int throttle_write(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        size_t chunk = len < THROTTLE_CHUNK ? len : THROTTLE_CHUNK;
+        uint64_t now = now_ns();
+        uint64_t wait_bytes = bucket_take(&bandwidth, (double)chunk, now);
+        uint64_t wait_ops = bucket_take(&operations, 1.0, now);
+        uint64_t wait = wait_bytes > wait_ops ? wait_bytes : wait_ops;
+        if (wait > 0) {
+            struct timespec delay = {(time_t)(wait / 1000000000u), (long)(wait % 1000000000u)};
+            nanosleep(&delay, NULL);
+            atomic_fetch_add_explicit(&throttled_ns, wait, memory_order_relaxed);
+        }
+
+        ssize_t written = write(fd, p, chunk);
+        if (written <= 0) {
+            perror("Error writing backup");
+            return 1;
+        }
+        atomic_fetch_add_explicit(&bytes, (uint64_t)written, memory_order_relaxed);
+        atomic_fetch_add_explicit(&writes, 1, memory_order_relaxed);
+        p += written;
+        len -= (size_t)written;
+        unflushed += (size_t)written;
+        if (gentle && unflushed >= GENTLE_FLUSH_BYTES) drop_pages(fd);
+    }
+    return 0;
+}
+
+void throttle_end(int fd) {
+    if (gentle && unflushed > 0) drop_pages(fd);
+    atomic_fetch_add_explicit(&busy_ns, now_ns() - backup_start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&backups, 1, memory_order_relaxed);
+}
+
+void throttle_stats(ThrottleStats *stats) {
+    stats->backups = atomic_load(&backups);
+    stats->bytes = atomic_load(&bytes);
+    stats->writes = atomic_load(&writes);
+    stats->busy_ns = atomic_load(&busy_ns);
+    stats->throttled_ns = atomic_load(&throttled_ns);
+}
@@ -0,0 +1,50 @@
+#ifndef KVS_THROTTLE_H
+#define KVS_THROTTLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Budget for backup I/O. Every write of a backup goes through
+/// throttle_write, which takes tokens from a bandwidth and an IOPS bucket
+/// and sleeps when either runs dry, so dumps cannot take the whole disk
+/// from the jobs writing their .out files. Meant for the backup thread:
+/// one backup is written at a time.
+
+typedef struct ThrottleStats {
+    uint64_t backups;         // Backups written
+    uint64_t bytes;           // Bytes written by backups
+    uint64_t writes;          // Write calls made by backups
+    uint64_t busy_ns;         // Time spent writing backups, throttling included
+    uint64_t throttled_ns;    // Time backups slept waiting for tokens
+} ThrottleStats;
+
+/// Sets the budget. Must be called before the first backup.
+/// @param bytes_per_sec Bandwidth for backups, 0 for no limit.
+/// @param iops Write calls per second for backups, 0 for no limit.
+/// @param gentle 1 to write backups at the lowest I/O priority and drop
+///        their pages from the page cache once they reach the disk.
+void throttle_configure(uint64_t bytes_per_sec, uint64_t iops, int gentle);
+
+/// Lowers the I/O priority of the calling thread if gentle mode is on.
+/// Called by the backup thread when it starts.
+void throttle_backup_thread();
+
+/// Marks the start of a backup.
+void throttle_begin();
+
+/// Writes part of a backup within the budget.
+/// @param fd Backup file.
+/// @param data Bytes to write.
+/// @param len Number of bytes.
+/// @return 0 on success, 1 if the file could not be written.
+int throttle_write(int fd, const void *data, size_t len);
+
+/// Marks the end of a backup, flushing its pages out of the cache in gentle mode.
+/// @param fd Backup file, still open.
+void throttle_end(int fd);
+
+/// Reads the backup I/O statistics.
+/// @param stats Where to store the statistics.
+void throttle_stats(ThrottleStats *stats);
+
+#endif  // KVS_THROTTLE_H
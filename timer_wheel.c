@@ -0,0 +1,158 @@
+#include "timer_wheel.h"
+
+#include <stdint.h>
+#include <time.h>
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_RANGE ((uint64_t)1 << (TW_SLOT_BITS * TW_LEVELS))
+
+static void list_push(TimerNode *head, TimerNode *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void list_unlink(TimerNode *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node->prev = NULL;
+}
+
+// Places a timer in the slot that covers its expiry. base is the first tick
+// that has not been processed yet; expiries before it fire on that tick.
+static void place(TimerWheel *tw, TimerNode *timer, uint64_t base) {
+    uint64_t expires = timer->expires;
+    if (expires < base)
+        expires = base;
+    uint64_t delta = expires - base;
+    if (delta >= TW_RANGE) {
+        // Too far away: park it at the edge of the wheel, it is re-placed on cascade
+        expires = base + TW_RANGE - 1;
+        delta = TW_RANGE - 1;
+    }
+
+    unsigned int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= ((uint64_t)1 << (TW_SLOT_BITS * (level + 1))))
+        level++;
+    unsigned int slot = (unsigned int)(expires >> (TW_SLOT_BITS * level)) & TW_MASK;
+    list_push(&tw->slots[level][slot], timer);
+}
+
+uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+void tw_init(TimerWheel *tw, uint64_t now) {
+    for (unsigned int l = 0; l < TW_LEVELS; l++) {
+        for (unsigned int s = 0; s < TW_SLOTS; s++) {
+            tw->slots[l][s].next = &tw->slots[l][s];
+            tw->slots[l][s].prev = &tw->slots[l][s];
+        }
+    }
+    tw->current = now;
+    tw->count = 0;
+}
+
+void tw_add(TimerWheel *tw, TimerNode *timer, uint64_t expires) {
+    timer->expires = expires;
+    place(tw, timer, tw->current + 1);
+    tw->count++;
+}
+
+void tw_del(TimerWheel *tw, TimerNode *timer) {
+    list_unlink(timer);
+    tw->count--;
+}
+
+// Moves every timer of a higher level slot down to the slot that now covers
+// it. Runs before the level 0 slot of tick, so timers due on tick still fire.
+static void cascade(TimerWheel *tw, unsigned int level, uint64_t tick) {
+    TimerNode *head = &tw->slots[level][(tick >> (TW_SLOT_BITS * level)) & TW_MASK];
+    TimerNode pending = {.next = head->next, .prev = head->prev};
+    if (head->next == head)
+        return;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    head->next = head->prev = head;
+
+    while (pending.next != &pending) {
+        TimerNode *timer = pending.next;
+        list_unlink(timer);
+        place(tw, timer, tick);
+    }
+}
+
+TimerNode *tw_advance(TimerWheel *tw, uint64_t now, size_t max_expired) {
+    TimerNode *expired = NULL, **tail = &expired;
+    size_t n = 0;
+
+    if (tw->count == 0) {
+        if (now > tw->current)
+            tw->current = now;
+        return NULL;
+    }
+
+    while (tw->current < now) {
+        uint64_t tick = tw->current + 1;
+        for (unsigned int level = TW_LEVELS - 1; level > 0; level--) {
+            if ((tick & (((uint64_t)1 << (TW_SLOT_BITS * level)) - 1)) == 0)
+                cascade(tw, level, tick);
+        }
+
+        TimerNode *head = &tw->slots[0][tick & TW_MASK];
+        while (head->next != head) {
+            if (max_expired != 0 && n == max_expired)
+                return expired;  // Resume this same tick on the next call
+            TimerNode *timer = head->next;
+            list_unlink(timer);
+            if (timer->expires > tick) {
+                // Timer clamped at the edge of the wheel, not due yet
+                place(tw, timer, tick + 1);
+                continue;
+            }
+            tw->count--;
+            *tail = timer;
+            tail = &timer->next;
+            n++;
+        }
+        tw->current = tick;
+
+        if (tw->count == 0) {
+            tw->current = now;
+            break;
+        }
+    }
+    return expired;
+}
+
+TimerNode *tw_drain(TimerWheel *tw) {
+    TimerNode *drained = NULL;
+    for (unsigned int l = 0; l < TW_LEVELS; l++) {
+        for (unsigned int s = 0; s < TW_SLOTS; s++) {
+            TimerNode *head = &tw->slots[l][s];
+            while (head->next != head) {
+                TimerNode *timer = head->next;
+                list_unlink(timer);
+                timer->next = drained;
+                drained = timer;
+            }
+        }
+    }
+    tw->count = 0;
+    return drained;
+}
+
+uint64_t tw_next_expiry(const TimerWheel *tw) {
+    if (tw->count == 0)
+        return UINT64_MAX;
+
+    for (uint64_t tick = tw->current + 1; tick <= tw->current + TW_SLOTS; tick++) {
+        const TimerNode *head = &tw->slots[0][tick & TW_MASK];
+        if (head->next != head || (tick & TW_MASK) == 0)
+            return tick;
+    }
+    return tw->current + TW_SLOTS;
+}
@@ -0,0 +1,67 @@
+#ifndef KVS_TIMER_WHEEL_H
+#define KVS_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TW_LEVELS 4
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1u << TW_SLOT_BITS)
+
+/// Intrusive timer node. Embed it in the structure that has to be woken up
+/// and recover the container with TW_CONTAINER_OF.
+typedef struct TimerNode {
+    struct TimerNode *next;
+    struct TimerNode *prev;
+    uint64_t expires;  // Absolute expiry, in ticks
+} TimerNode;
+
+/// Hierarchical timer wheel with TW_LEVELS levels of TW_SLOTS slots each.
+/// Not thread safe: callers serialize access with their own lock.
+typedef struct TimerWheel {
+    TimerNode slots[TW_LEVELS][TW_SLOTS];  // Sentinels of circular lists
+    uint64_t current;                      // Last tick that was processed
+    size_t count;                          // Number of armed timers
+} TimerWheel;
+
+#define TW_CONTAINER_OF(ptr, type, member) \
+    ((type *)(void *)((char *)(ptr) - offsetof(type, member)))
+
+/// Reads the monotonic clock. Wheels in this project tick in milliseconds.
+/// @return Milliseconds since an arbitrary fixed point.
+uint64_t monotonic_ms();
+
+/// Initializes an empty wheel.
+/// @param tw Wheel to initialize.
+/// @param now Current tick.
+void tw_init(TimerWheel *tw, uint64_t now);
+
+/// Arms a timer. Expiries in the past fire on the next advance.
+/// @param tw Wheel to modify.
+/// @param timer Timer to arm, must not be armed already.
+/// @param expires Absolute expiry tick.
+void tw_add(TimerWheel *tw, TimerNode *timer, uint64_t expires);
+
+/// Disarms a timer.
+/// @param tw Wheel to modify.
+/// @param timer Armed timer to remove.
+void tw_del(TimerWheel *tw, TimerNode *timer);
+
+/// Advances the wheel up to now, unlinking every timer that expired.
+/// @param tw Wheel to advance.
+/// @param now Current tick.
+/// @param max_expired Maximum number of timers to return; 0 means no limit.
+/// @return Singly linked list (through next) of expired timers, NULL if none.
+TimerNode *tw_advance(TimerWheel *tw, uint64_t now, size_t max_expired);
+
+/// Disarms every timer, whatever its expiry.
+/// @param tw Wheel to empty.
+/// @return Singly linked list (through next) of the timers that were armed.
+TimerNode *tw_drain(TimerWheel *tw);
+
+/// Returns a lower bound for the next expiry.
+/// @param tw Wheel to inspect.
+/// @return Tick of the next possible expiry, UINT64_MAX if the wheel is empty.
+uint64_t tw_next_expiry(const TimerWheel *tw);
+
+#endif  // KVS_TIMER_WHEEL_H
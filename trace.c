@@ -0,0 +1,165 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_EVENTS_PER_THREAD 16384  // Oldest spans are overwritten first
+#define TRACE_DETAIL_SIZE 48
+
+typedef struct TraceEvent {
+    const char *name;
+    uint64_t start, duration;
+    char detail[TRACE_DETAIL_SIZE];
+} TraceEvent;
+
+// Written only by the thread that holds it; read by trace_dump once the
+// threads are done. A thread that exits hands its buffer to the next thread
+// that starts, so threads that come and go, such as parsers and compressors,
+// share one track in the trace instead of one buffer each.
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    struct TraceBuffer *next_free;
+    unsigned int tid;
+    const char *thread_name;
+    uint64_t count;  // Spans recorded, including overwritten ones
+    TraceEvent events[TRACE_EVENTS_PER_THREAD];
+} TraceBuffer;
+
+int trace_enabled = 0;
+
+static _Atomic(TraceBuffer *) buffers = NULL;
+static atomic_uint next_tid = 1;
+static _Thread_local TraceBuffer *local_buffer = NULL;
+
+static pthread_key_t buffer_key;  // Hands the buffer back when its thread exits
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *free_buffers = NULL;
+
+static void release_buffer(void *arg) {
+    TraceBuffer *buffer = arg;
+    pthread_mutex_lock(&free_lock);
+    buffer->next_free = free_buffers;
+    free_buffers = buffer;
+    pthread_mutex_unlock(&free_lock);
+}
+
+void trace_enable() {
+    if (pthread_key_create(&buffer_key, release_buffer) != 0) {
+        perror("Failed to enable tracing");
+        return;
+    }
+    trace_enabled = 1;
+}
+
+uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Takes the buffer of a thread that exited, or registers a new one with a
+// lock-free push.
+static TraceBuffer *thread_buffer() {
+    if (local_buffer) return local_buffer;
+    pthread_mutex_lock(&free_lock);
+    TraceBuffer *buffer = free_buffers;
+    if (buffer) free_buffers = buffer->next_free;
+    pthread_mutex_unlock(&free_lock);
+
+    if (!buffer) {
+        buffer = malloc(sizeof(TraceBuffer));
+        if (!buffer) return NULL;
+        buffer->tid = atomic_fetch_add(&next_tid, 1);
+        buffer->count = 0;
+        buffer->next = atomic_load(&buffers);
+        while (!atomic_compare_exchange_weak(&buffers, &buffer->next, buffer))
+            ;
+    }
+    buffer->thread_name = NULL;
+    pthread_setspecific(buffer_key, buffer);
+    local_buffer = buffer;
+    return buffer;
+}
+
+void trace_thread_name(const char *name) {
+    if (!trace_enabled) return;
+    TraceBuffer *buffer = thread_buffer();
+    if (buffer) buffer->thread_name = name;
+}
+
+void trace_span(const char *name, uint64_t start, const char *detail) {
+    uint64_t end = trace_now();
+    TraceBuffer *buffer = thread_buffer();
+    if (!buffer) return;
+    TraceEvent *event = &buffer->events[buffer->count++ % TRACE_EVENTS_PER_THREAD];
+    event->name = name;
+    event->start = start;
+    event->duration = end - start;
+    event->detail[0] = '\0';
+    if (detail) {
+        // Keep the tail of long details: for paths it is the part that tells jobs apart
+        size_t len = strlen(detail);
+        const char *tail = len >= TRACE_DETAIL_SIZE ? detail + len - (TRACE_DETAIL_SIZE - 1) : detail;
+        memcpy(event->detail, tail, strlen(tail) + 1);
+    }
+}
+
+static void write_escaped(FILE *out, const char *text) {
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(out, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(out, "\\u%04x", *p);
+        else
+            fputc(*p, out);
+    }
+}
+
+int trace_dump(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        perror("Error opening trace file");
+    }
+
+    const char *sep = "";
+    if (out) fprintf(out, "{\"traceEvents\":[\n");
+    TraceBuffer *buffer = atomic_exchange(&buffers, NULL);
+    pthread_mutex_lock(&free_lock);
+    free_buffers = NULL;
+    pthread_mutex_unlock(&free_lock);
+    while (buffer) {
+        if (out) {
+            if (buffer->thread_name) {
+                fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                        sep, buffer->tid, buffer->thread_name);
+                sep = ",\n";
+            }
+            uint64_t first = buffer->count > TRACE_EVENTS_PER_THREAD ? buffer->count - TRACE_EVENTS_PER_THREAD : 0;
+            for (uint64_t i = first; i < buffer->count; i++) {
+                const TraceEvent *event = &buffer->events[i % TRACE_EVENTS_PER_THREAD];
+                fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"kvs\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                        sep, event->name, buffer->tid, (double)event->start / 1000.0, (double)event->duration / 1000.0);
+                if (event->detail[0]) {
+                    fprintf(out, ",\"args\":{\"detail\":\"");
+                    write_escaped(out, event->detail);
+                    fprintf(out, "\"}");
+                }
+                fputc('}', out);
+                sep = ",\n";
+            }
+            if (first > 0) {
+                fprintf(stderr, "trace: thread %u dropped its %llu oldest spans\n", buffer->tid, (unsigned long long)first);
+            }
+        }
+        TraceBuffer *next = buffer->next;
+        free(buffer);
+        buffer = next;
+    }
+    if (!out) return 1;
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(out) != 0;
+}
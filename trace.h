@@ -0,0 +1,41 @@
+#ifndef KVS_TRACE_H
+#define KVS_TRACE_H
+
+#include <stdint.h>
+
+/// Span tracing. Each thread records complete spans into its own ring
+/// buffer, without locks, and trace_dump writes all of them as Chrome
+/// trace-event JSON (viewable in Perfetto or chrome://tracing). Buffers of
+/// threads that exited are reused by new threads, so memory follows the
+/// number of live threads. When tracing is off a span costs one predictable
+/// branch on trace_enabled.
+
+extern int trace_enabled;
+
+/// Enables tracing. Must be called before any thread records spans.
+void trace_enable();
+
+/// Names the calling thread in the trace.
+/// @param name Thread name, must be a string literal.
+void trace_thread_name(const char *name);
+
+/// Reads the clock for the start of a span.
+/// @return Start timestamp in nanoseconds.
+uint64_t trace_now();
+
+/// Records a span that started at start and ends now.
+/// @param name Span name, must be a string literal.
+/// @param start Value returned by TRACE_BEGIN.
+/// @param detail Optional text shown with the span, copied; may be NULL.
+void trace_span(const char *name, uint64_t start, const char *detail);
+
+/// Writes every recorded span to a file and frees the buffers.
+/// @param path File to write the JSON to.
+/// @return 0 if the trace was written, 1 otherwise.
+int trace_dump(const char *path);
+
+#define TRACE_BEGIN() (trace_enabled ? trace_now() : 0)
+#define TRACE_END(name, start, detail) \
+    do { if (trace_enabled) trace_span((name), (start), (detail)); } while (0)
+
+#endif  // KVS_TRACE_H